@@ -0,0 +1,8 @@
+/*
+ * config.h - where memlib places the heap. MAX_DENSE_HEAP is the size of
+ * the first region, mapped by mem_init; the heap grows past it into further
+ * regions. TRY_DENSE_HEAP_START is the address asked for, and a file-backed
+ * heap is always mapped there since it holds absolute pointers.
+ */
+#define MAX_DENSE_HEAP (1L<<31)
+#define TRY_DENSE_HEAP_START (void *) 0x800000000
@@ -5,7 +5,21 @@
  * package with the system's malloc package in libc.
  *
  * This version has been updated to enable sparse emulation of very large heaps
+ *
+ * The heap is a list of regions, each a separate reservation. When the last
+ * region cannot fit a request, mem_sbrk hands out the room left at the end of
+ * an older one, or else reserves a new one twice as big and carries on there,
+ * so the heap is only bounded by the address space. Regions are not
+ * contiguous. A region is reserved inaccessible, which costs no commit charge,
+ * and opened for reading and writing MEM_COMMIT_STEP at a time as its break
+ * advances, so the commit charge follows the heap rather than its reservations.
+ *
+ * mem_init_file backs the heap with a shared file mapped at a fixed base instead
+ * of /dev/zero, so a heap can outlive the process. The first page of the file
+ * is a header holding the break and a root area the allocator can keep its own
+ * state in; the heap itself starts on the next page.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -16,91 +30,376 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "memlib.h"
 #include "config.h"
 
+#define MEM_FILE_MAGIC 0x6d6d686561700001ULL
+#define MEM_MAX_REGIONS 48
+#define MEM_MIN_REGION (1L<<20) /* smallest first region mem_init settles for */
+#define MEM_COMMIT_STEP (1L<<20) /* bytes of a region opened at a time */
+
+/* header page of a file-backed heap */
+typedef struct {
+    uint64_t magic;             /* MEM_FILE_MAGIC once the header is valid */
+    void *base;                 /* address the file was mapped at */
+    size_t brk;                 /* break offset at the last mem_deinit */
+    size_t dirty_hi;            /* dirty limit offset at the last mem_deinit */
+} mem_header_t;
+
+/* one reservation of the heap */
+typedef struct {
+    unsigned char *lo;                  /* first byte */
+    _Atomic(unsigned char *) brk;       /* current break */
+    unsigned char *max_addr;            /* maximum allowable address */
+    unsigned char *dirty_hi;            /* highest break reached before the last reset */
+    _Atomic(unsigned char *) committed; /* end of the part open for reading and writing */
+    size_t length;                      /* number of bytes allocated by mmap */
+} mem_region_t;
+
 /* private global variables */
 static unsigned char *heap;                 /* Starting address of heap */
-static unsigned char *mem_brk;              /* Current position of break */
-static unsigned char *mem_max_addr;         /* Maximum allowable heap address */
+static mem_region_t regions[MEM_MAX_REGIONS]; /* Regions of the heap, regions[0] starts at heap */
+static _Atomic int region_num = 0;          /* Regions in use; mem_sbrk grows the last one */
+static pthread_mutex_t region_lock = PTHREAD_MUTEX_INITIALIZER; /* Serializes adding regions */
 static size_t mmap_length = MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
 static bool show_stats = false;             /* Should program print allocation information? */
 static bool stats_printed = false;          /* Has information been printed about allocation */
+static mem_header_t *header = NULL;         /* Header page of a file-backed heap, NULL otherwise */
+static int heap_fd = -1;                    /* Backing file of a file-backed heap */
 
 static void print_stats();
+static bool add_region(int n, size_t incr);
+static void *region_sbrk(mem_region_t *r, size_t incr);
+static bool commit_region(mem_region_t *r, unsigned char *end);
+static void *reserve_region(void *start, size_t length);
+static void set_region(int i, unsigned char *lo, size_t length, unsigned char *brk, unsigned char *dirty_hi);
 
 /* 
- * mem_init - initialize the memory system model
+ * mem_init - initialize the memory system model. The first region is
+ *            halved until it can be mapped, down to MEM_MIN_REGION, since
+ *            the heap grows into further regions anyway. Without DRIVER,
+ *            where this backs the program's own malloc, a heap that cannot
+ *            be mapped at all is left empty, so every mem_sbrk fails with
+ *            ENOMEM, instead of ending the program.
  */
 void mem_init(){
-    /* Dense allocation */
-    mmap_length = MAX_DENSE_HEAP;
+    void *addr;
 
-    int dev_zero = open("/dev/zero", O_RDWR);
     void *start = TRY_DENSE_HEAP_START;
-    void *addr = mmap(start,        /* suggested start*/
-                      mmap_length,  /* length */
-                      PROT_WRITE,   /* permissions */
-                      MAP_PRIVATE,  /* private or shared? */
-                      dev_zero,            /* fd */
-                      0);            /* offset */
+    mmap_length = MAX_DENSE_HEAP;
+    for (;;) {
+        /* Dense allocation */
+        addr = reserve_region(start, mmap_length);
+        if (addr != MAP_FAILED || mmap_length / 2 < MEM_MIN_REGION)
+            break;
+        mmap_length /= 2;
+    }
     if (addr == MAP_FAILED) {
+#ifdef DRIVER
         fprintf(stderr, "FAILURE.  mmap couldn't allocate space for heap\n");
         exit(1);
+#else
+        region_num = 0;
+        return;
+#endif
     }
-    
+
     heap = addr;
-    mem_max_addr = heap + MAX_DENSE_HEAP;
-    
+    set_region(0, heap, mmap_length, heap, heap);
+    region_num = 1;
+
     stats_printed = false;
-    mem_brk = heap;
     mem_reset_brk();
 }
 
+/*
+ * mem_init_file - initialize the memory system model on a heap kept in the
+ *                 file at path, creating it if needed. The file is always
+ *                 mapped at TRY_DENSE_HEAP_START, since the heap holds
+ *                 absolute pointers. Returns true if the file already held a
+ *                 heap, whose break is restored, and false for a new one.
+ *                 While the file is mapped its header counts all of it as
+ *                 written, so a process that dies before mem_deinit leaves no
+ *                 memory that the next one would take for fresh zeros.
+ */
+bool mem_init_file(const char *path){
+    size_t page = mem_pagesize();
+    mmap_length = MAX_DENSE_HEAP + page;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0 || ftruncate(fd, mmap_length) != 0) {
+        fprintf(stderr, "FAILURE.  couldn't open heap file %s\n", path);
+        exit(1);
+    }
+    void *start = TRY_DENSE_HEAP_START;
+    void *addr = mmap(start,                        /* required start */
+                      mmap_length,                  /* length */
+                      PROT_READ | PROT_WRITE,       /* permissions */
+                      MAP_SHARED | MAP_FIXED_NOREPLACE, /* private or shared? */
+                      fd,                           /* fd */
+                      0);                           /* offset */
+    if (addr != start) {
+        fprintf(stderr, "FAILURE.  mmap couldn't map heap file at %p\n", start);
+        exit(1);
+    }
+
+    header = addr;
+    heap_fd = fd;
+    heap = (unsigned char *) addr + page;
+    region_num = 1;
+    stats_printed = false;
+
+    /* the file is the whole heap: it never grows a second region */
+    bool attached = header->magic == MEM_FILE_MAGIC && header->base == addr;
+    if (attached) {
+        set_region(0, heap, MAX_DENSE_HEAP, heap + header->brk, heap + header->dirty_hi);
+    } else {
+        /* an old file may hold anything: empty it, or take all of it as written */
+        bool emptied = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, mmap_length) == 0;
+        memset(header, 0, page);
+        header->magic = MEM_FILE_MAGIC;
+        header->base = addr;
+        set_region(0, heap, MAX_DENSE_HEAP, heap, emptied ? heap : heap + MAX_DENSE_HEAP);
+    }
+    /* until mem_deinit records the real limit, a process dying with the heap
+       mapped leaves every byte of the file possibly written */
+    header->dirty_hi = MAX_DENSE_HEAP;
+    return attached;
+}
+
 /* 
- * mem_deinit - free the storage used by the memory system model
+ * mem_deinit - free the storage used by the memory system model. A
+ *              file-backed heap records its break and is flushed first.
  */
 void mem_deinit(void){
     print_stats();
-    munmap(heap, mmap_length);
+    if (header != NULL) {
+        header->brk = mem_heapsize();
+        header->dirty_hi = regions[0].dirty_hi - heap;
+        msync(header, mmap_length, MS_SYNC);
+        munmap(header, mmap_length);
+        close(heap_fd);
+        header = NULL;
+        heap_fd = -1;
+    } else {
+        int i;
+        for (i = 0; i < region_num; i++)
+            munmap(regions[i].lo, regions[i].length);
+    }
+    region_num = 0;
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_root_area - returns the part of the header page left for the allocator
+ *                 to keep its own state across restarts, or NULL if the heap
+ *                 is not file-backed. mem_root_size gives its length.
+ */
+void *mem_root_area(void){
+    if (header == NULL)
+        return NULL;
+    return (void *)((unsigned char *) header + sizeof(mem_header_t));
+}
+
+size_t mem_root_size(void){
+    return mem_pagesize() - sizeof(mem_header_t);
+}
+
+/*
+ * mem_lock - holds off any new region until mem_unlock, for example so that
+ *            no fork copies the region list while it is being changed
+ */
+void mem_lock(void){
+    pthread_mutex_lock(&region_lock);
+}
+
+void mem_unlock(void){
+    pthread_mutex_unlock(&region_lock);
+}
+
+/*
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *                 releasing every region but the first
  */
 void mem_reset_brk(){
     print_stats();
-    mem_brk = heap;
+    pthread_mutex_lock(&region_lock);
+    while (region_num > 1) {
+        region_num--;
+        munmap(regions[region_num].lo, regions[region_num].length);
+    }
+    if (regions[0].brk > regions[0].dirty_hi)
+        regions[0].dirty_hi = regions[0].brk;
+    regions[0].brk = heap;
+    pthread_mutex_unlock(&region_lock);
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
  *                by incr bytes and returns the start address of the new area. In
- *                this model, the heap cannot be shrunk.
+ *                this model, the heap cannot be shrunk. The break is bumped with a
+ *                compare-and-swap, so concurrent callers only serialize on a lock
+ *                or a system call when the break crosses into pages not yet open;
+ *                each gets its own contiguous range. A request the last region
+ *                cannot fit is served from an older region or a new one, so two
+ *                calls in a row may return ranges far apart.
  */
 void *mem_sbrk(intptr_t incr) {
-    unsigned char *old_brk = mem_brk;
-
-    bool ok = true;
     if (incr < 0) {
-        ok = false;
+#ifdef DRIVER
         fprintf(stderr, "ERROR: mem_sbrk failed.  Attempt to expand heap by negative value %ld\n", (long) incr);
-    } else if (mem_brk + incr > mem_max_addr) {
-        ok = false;
-        size_t alloc = mem_brk - heap + incr;
-        fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory.  Would require heap size of %zd (0x%zx) bytes\n", alloc, alloc);
-    } else if (sbrk(incr) == (void*) -1) {
-        ok = false;
-        fprintf(stderr, "ERROR: mem_sbrk failed.  Could not allocate more heap space\n");
-    }
-    if (ok) {
-        mem_brk += incr;
-        return (void *) old_brk;
-    } else {
+#endif
         errno = ENOMEM;
         return (void *) -1;
     }
+    for (;;) {
+        int n = atomic_load_explicit(&region_num, memory_order_acquire);
+        if (n == 0) { /* mem_init could not map the heap */
+            errno = ENOMEM;
+            return (void *) -1;
+        }
+        /* the last region first, then the room left at the end of older ones */
+        int i;
+        for (i = n - 1; i >= 0; i--) {
+            void *addr = region_sbrk(&regions[i], incr);
+            if (addr == (void *) -1) { /* the system would not back the pages */
+                errno = ENOMEM;
+                return addr;
+            }
+            if (addr != NULL)
+                return addr;
+        }
+        if (!add_region(n, incr)) {
+#ifdef DRIVER
+            size_t alloc = mem_heapsize() + incr;
+            fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory.  Would require heap size of %zd (0x%zx) bytes\n", alloc, alloc);
+#endif
+            errno = ENOMEM;
+            return (void *) -1;
+        }
+    }
+}
+
+/*
+ * mem_sbrk_at - extends the heap by incr bytes like mem_sbrk, but only if the
+ *               break of a region is at at, so whoever got the last range of
+ *               that region can grow it in place. Returns at, or (void *) -1
+ *               if something else has been handed out behind at since or the
+ *               region has no room left.
+ */
+void *mem_sbrk_at(void *at, intptr_t incr) {
+    int n = atomic_load_explicit(&region_num, memory_order_acquire);
+    int i;
+
+    for (i = 0; i < n && incr >= 0; i++) {
+        mem_region_t *r = &regions[i];
+        unsigned char *old_brk = at;
+        if (old_brk < r->lo || old_brk > r->max_addr)
+            continue;
+        if ((size_t)(r->max_addr - old_brk) >= (size_t) incr
+            && (old_brk + incr <= atomic_load_explicit(&r->committed, memory_order_acquire)
+                || commit_region(r, old_brk + incr))
+            && atomic_compare_exchange_strong_explicit(&r->brk, &old_brk, old_brk + incr,
+                                                       memory_order_relaxed, memory_order_relaxed))
+            return at;
+        break;
+    }
+    errno = ENOMEM;
+    return (void *) -1;
+}
+
+/*
+ * mem_sbrk_fresh - returns true if addr lies at or above every break handed out
+ *                  in its region since the region was mapped. Memory returned by
+ *                  mem_sbrk there has never been written and still reads as zero.
+ */
+bool mem_sbrk_fresh(const void *addr) {
+    int n = atomic_load_explicit(&region_num, memory_order_acquire);
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if ((const unsigned char *) addr >= regions[i].lo && (const unsigned char *) addr < regions[i].max_addr)
+            return (const unsigned char *) addr >= regions[i].dirty_hi;
+    }
+    return false;
+}
+
+/*
+ * mem_in_heap - returns true if [addr, addr + len) lies below the break of
+ *               a single region.
+ */
+bool mem_in_heap(const void *addr, size_t len) {
+    int n = atomic_load_explicit(&region_num, memory_order_acquire);
+    int i;
+
+    for (i = 0; i < n; i++) {
+        const unsigned char *lo = regions[i].lo;
+        const unsigned char *brk = atomic_load_explicit(&regions[i].brk, memory_order_relaxed);
+        if ((const unsigned char *) addr >= lo && (const unsigned char *) addr <= brk
+            && len <= (size_t)(brk - (const unsigned char *) addr))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * mem_region_count - returns the number of regions in the heap. Regions
+ *                    are numbered in the order they were added, and each
+ *                    holds the bytes from mem_region_lo to mem_region_hi.
+ */
+int mem_region_count(void) {
+    return atomic_load_explicit(&region_num, memory_order_acquire);
+}
+
+void *mem_region_lo(int i) {
+    return (void *) regions[i].lo;
+}
+
+void *mem_region_hi(int i) {
+    return (void *)(atomic_load_explicit(&regions[i].brk, memory_order_relaxed) - 1);
+}
+
+/*
+ * mem_discard - releases the physical pages behind [addr, addr + len), which must
+ *               be page aligned. The range reads back as zero afterwards: from
+ *               /dev/zero for a private heap, or from the hole punched in the
+ *               file for a file-backed one. Returns false if the pages could
+ *               not be released and still hold their old contents.
+ */
+bool mem_discard(void *addr, size_t len) {
+    if (header != NULL) {
+        /* shared pages would be read back from the file, so punch them out of it */
+        off_t offset = (unsigned char *) addr - (unsigned char *) header;
+        return fallocate(heap_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0;
+    }
+    return madvise(addr, len, MADV_DONTNEED) == 0;
+}
+
+/*
+ * mem_reserve_area - reserves len bytes of address space outside the heap,
+ *                    inaccessible until mem_protect opens them. Returns NULL
+ *                    if the reservation fails.
+ */
+void *mem_reserve_area(size_t len) {
+    void *addr = mmap(NULL, len, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return (addr == MAP_FAILED) ? NULL : addr;
+}
+
+/*
+ * mem_protect - opens the page aligned range [addr, addr + len) of an area from
+ *               mem_reserve_area for reading and writing, or closes it again.
+ *               Closing also releases its pages, so the range reads back as
+ *               zero the next time it is opened. Returns false on failure.
+ */
+bool mem_protect(void *addr, size_t len, bool access) {
+    if (access)
+        return mprotect(addr, len, PROT_READ | PROT_WRITE) == 0;
+    return madvise(addr, len, MADV_DONTNEED) == 0
+        && mprotect(addr, len, PROT_NONE) == 0;
 }
 
 /*
@@ -111,17 +410,23 @@ void *mem_heap_lo(){
 }
 
 /* 
- * mem_heap_hi - return address of last heap byte
+ * mem_heap_hi - return address of last heap byte in the last region
  */
 void *mem_heap_hi(){
-    return (void *)(mem_brk - 1);
+    return mem_region_hi(mem_region_count() - 1);
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_heapsize() - returns the heap size in bytes, summed over all regions
  */
 size_t mem_heapsize() {
-    return (size_t)(mem_brk - heap);
+    int n = mem_region_count();
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        size += (size_t)((unsigned char *) mem_region_hi(i) + 1 - regions[i].lo);
+    return size;
 }
 
 /*
@@ -134,13 +439,127 @@ size_t mem_pagesize(){
 
 /*************** Private Functions *******************/
 
+/*
+ * add_region - reserves a new last region for a request of incr bytes that
+ *              did not fit in region n - 1. Returns true if region_num has
+ *              moved past n, whether this call or another thread added it.
+ *              A region is twice the size of the last one, or just big
+ *              enough for the request when that much address space cannot
+ *              be reserved.
+ */
+static bool add_region(int n, size_t incr) {
+    bool ok = true;
+
+    pthread_mutex_lock(&region_lock);
+    if (region_num == n) {
+        size_t page = mem_pagesize();
+        size_t length = 2 * regions[n - 1].length;
+
+        /* reserve one page more than is handed out, so no region ever ends where the next one begins */
+        size_t needed = (incr + 2 * page - 1) & ~(page - 1);
+        if (needed < incr)
+            needed = SIZE_MAX;
+        if (length < needed)
+            length = needed;
+        void *addr = MAP_FAILED;
+        if (header == NULL && n < MEM_MAX_REGIONS && needed != SIZE_MAX) {
+            addr = reserve_region(NULL, length);
+            if (addr == MAP_FAILED && length > needed) {
+                length = needed; // doubling overshot what is left, so settle for the request
+                addr = reserve_region(NULL, length);
+            }
+        }
+        if (addr == MAP_FAILED) {
+            ok = false;
+        } else {
+            set_region(n, addr, length, addr, addr);
+            atomic_store_explicit(&region_num, n + 1, memory_order_release);
+        }
+    }
+    pthread_mutex_unlock(&region_lock);
+    return ok;
+}
+
+/*
+ * region_sbrk - bumps the break of region r by incr bytes, opening the pages
+ *               below the new break first. Returns the old break, NULL if the
+ *               region has no room left, or (void *) -1 if its pages could not
+ *               be committed.
+ */
+static void *region_sbrk(mem_region_t *r, size_t incr) {
+    unsigned char *old_brk = atomic_load_explicit(&r->brk, memory_order_relaxed);
+
+    while ((size_t)(r->max_addr - old_brk) >= incr) {
+        if (old_brk + incr > atomic_load_explicit(&r->committed, memory_order_acquire)
+            && !commit_region(r, old_brk + incr))
+            return (void *) -1;
+        if (atomic_compare_exchange_weak_explicit(&r->brk, &old_brk, old_brk + incr,
+                                                  memory_order_relaxed, memory_order_relaxed))
+            return (void *) old_brk;
+    }
+    return NULL;
+}
+
+/*
+ * commit_region - opens the pages of region r up to end for reading and
+ *                 writing, MEM_COMMIT_STEP at a time, or just the pages
+ *                 needed if the system will not back a whole step. Returns
+ *                 false if it will not back those either.
+ */
+static bool commit_region(mem_region_t *r, unsigned char *end) {
+    size_t page = mem_pagesize();
+    bool ok = true;
+
+    pthread_mutex_lock(&region_lock);
+    unsigned char *committed = atomic_load_explicit(&r->committed, memory_order_relaxed);
+    if (end > committed) {
+        size_t len = ((size_t)(end - committed) + MEM_COMMIT_STEP - 1) & ~(size_t)(MEM_COMMIT_STEP - 1);
+        if (len > (size_t)(r->max_addr - committed))
+            len = r->max_addr - committed;
+        if (mprotect(committed, len, PROT_READ | PROT_WRITE) != 0) {
+            len = ((size_t)(end - committed) + page - 1) & ~(page - 1);
+            ok = mprotect(committed, len, PROT_READ | PROT_WRITE) == 0;
+        }
+        if (ok)
+            atomic_store_explicit(&r->committed, committed + len, memory_order_release);
+    }
+    pthread_mutex_unlock(&region_lock);
+    return ok;
+}
+
+/*
+ * reserve_region - reserves length bytes of inaccessible address space,
+ *                  preferably at start. Until commit_region opens them, the
+ *                  pages count against no commit limit. MAP_NORESERVE is left
+ *                  out on purpose: it would exempt the later mprotect from
+ *                  accounting too, and a request no memory could back would
+ *                  then succeed. Returns MAP_FAILED on failure.
+ */
+static void *reserve_region(void *start, size_t length) {
+    return mmap(start, length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+}
+
+/*
+ * set_region - fills in regions[i] for a reservation of length bytes at lo.
+ *              The last page is never handed out by mem_sbrk, nor opened.
+ *              A file-backed heap is mapped open, a reservation closed.
+ */
+static void set_region(int i, unsigned char *lo, size_t length, unsigned char *brk, unsigned char *dirty_hi) {
+    regions[i].lo = lo;
+    regions[i].length = length;
+    regions[i].max_addr = lo + length - mem_pagesize();
+    regions[i].brk = brk;
+    regions[i].dirty_hi = dirty_hi;
+    regions[i].committed = (header != NULL) ? regions[i].max_addr : lo;
+}
+
 
 static void print_stats() {
     size_t vbytes = mem_heapsize();
     if (!show_stats || vbytes == 0 || stats_printed)
         return;
     printf("Allocated %zu heap bytes.  Max address = %p\n",
-           vbytes, mem_brk);
+           vbytes, (unsigned char *) mem_heap_hi() + 1);
     stats_printed = true;
 }
 
@@ -4,9 +4,23 @@
 #include <stdbool.h>
 
 void mem_init();               
+bool mem_init_file(const char *path);
 void mem_deinit(void);
+void *mem_root_area(void);
+size_t mem_root_size(void);
 void *mem_sbrk(intptr_t incr);
+void *mem_sbrk_at(void *at, intptr_t incr);
+bool mem_sbrk_fresh(const void *addr);
+bool mem_discard(void *addr, size_t len);
+void *mem_reserve_area(size_t len);
+bool mem_protect(void *addr, size_t len, bool access);
+bool mem_in_heap(const void *addr, size_t len);
+int mem_region_count(void);
+void *mem_region_lo(int i);
+void *mem_region_hi(int i);
 void mem_reset_brk(void); 
+void mem_lock(void);
+void mem_unlock(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
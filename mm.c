@@ -9,6 +9,14 @@ A block variable is a union composed of a payload and two pointers to a free lis
 *          When the block is freed, it will have a header and a footer, and the two free list pointers will override the payload.
 *          When the block is allocated, it will only have a header and the payload will override the two pointers.
 Organization of the free list: The free lists are segregated free lists with user-defined categories. Nth fitting is performed also with user-defined variables.
+Large blocks: Requests of at least large_size bytes never touch the segregated lists or the heap lock. Each is carved from memlib in its own region bounded by a prologue and an epilogue, rounded up to one of four size classes per power of two, and recycled through a per-class free list with its own lock. Free large blocks keep at most large_cache_size bytes resident; a block freed past that has its pages discarded first and is listed as a zero block. realloc grows a large block in place when its region is the last one carved, by moving the break, or when the region behind it holds a free large block of about the size needed, by taking over that region.
+Purging: Free blocks spanning whole pages can have those pages returned to the system with mm_purge, or periodically by a background thread from mm_purge_start. A pass flags every such block idle; a block still idle on the next pass has been free for a full period, so its interior pages are discarded, its edges zeroed, and it is flagged zero.
+Persistence: On a heap mapped from a file by mem_init_file, mm_detach saves the free list roots and the other heap globals in memlib's header page, and mm_attach restores and checks them on the next start instead of building a new heap. mm_set_root and mm_get_root keep one application pointer alongside them.
+Compaction: Blocks from mm_malloc_movable are flagged movable and keep a pointer to the caller's handle in front of the payload, so on a file-backed heap the handle must itself live in the heap. Each heap segment's prologue links to the one before, and mm_compact walks that list under heap_lock alone, sliding every movable block that follows a free block down into it and updating the handle, so free space collects below the next fixed block or at the top of a segment. The holes left are taken off the lists in batches and their pages discarded with the lock released.
+Interposition: Built without DRIVER, this file replaces the system malloc, so the first allocation sets up memlib and the heap itself, and fork handlers keep every lock consistent in the child. Aligned payloads are cut out of a bigger small block, whose leading and trailing parts are freed again; inside a large block, an aligned payload is instead preceded by a tag word pointing back to the block's header.
+Bounded latency: Built with BOUNDED_LATENCY, the segregated lists split every power of two into four, and a bitmap of non-empty lists lets find_fit pick a block that surely fits in constant time. mm_reserve grows the heap and faults in its pages ahead of time, so mallocs served from the reserve make no system call.
+Guard pages: Built with GUARD_PAGES, one malloc in every mm_guard_sample, picked at random, is served from a separate area instead of the heap: its payload ends where an inaccessible guard page begins, so an overflow faults on the spot. A freed guarded block's page is made inaccessible too and stays so while the next guard_quarantine guarded blocks are freed, so a use after free faults as well.
+Concurrency: All heap state is guarded by one lock. A free that finds the lock taken does not wait; it pushes the block onto a lock-free remote free queue with a single CAS, and whichever thread next holds the lock drains the queue in malloc before searching the free lists.
 ******
  */
 
@@ -31,10 +39,37 @@ Organization of the free list: The free lists are segregated free lists with use
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define malloc_usable_size mm_malloc_usable_size
+#define malloc_with_size mm_malloc_with_size
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
+#define memalign mm_memalign
+#define valloc mm_valloc
+#define pvalloc mm_pvalloc
+#define reallocarray mm_reallocarray
 #endif /* def DRIVER */
 
 /* You can change anything from here onward */
 
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/random.h>
+#include <time.h>
+#include <errno.h>
+
+/*
+ * With sys/sdt.h available, the probe_ helpers below place USDT probes in provider mm, which compile
+ * to single nops that tracers such as bpftrace can attach to on a running process (see mm.bt).
+ * Without it, they compile to nothing.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define USDT_PROBES
+#endif
+#endif
+
 /*
  * If DEBUG is defined, enable printing on dbg_printf and contracts.
  * Debugging macros, with names beginning "dbg_" are allowed.
@@ -56,14 +91,50 @@ Organization of the free list: The free lists are segregated free lists with use
 #define dbg_ensures(...)
 #endif
 
+/*
+ * If HARDENED is defined, the allocator checks its own metadata as it goes:
+ * free list links are XOR-encoded with a per-heap secret and their own
+ * address, unlinking verifies that both neighbours point back at the block,
+ * allocated footers carry a canary derived from a second secret, and free
+ * rejects blocks that are not allocated. Any failed check reports the damage and aborts.
+ */
+// #define HARDENED // uncomment this line to enable hardened allocation
+
+/*
+ * If BOUNDED_LATENCY is defined, the segregated lists become a two-level
+ * segregated fit index: four lists per power of two, and a bitmap of the lists
+ * holding blocks, so find_fit takes the first block of the first list whose
+ * every block fits instead of comparing up to N candidates. Each malloc also
+ * releases at most drain_batch remotely freed blocks. With the heap grown and
+ * faulted in ahead of time by mm_reserve, small mallocs and frees then finish
+ * in a bounded number of steps, without a system call, until the reserve runs out.
+ */
+// #define BOUNDED_LATENCY // uncomment this line to enable bounded latency allocation
+
+/*
+ * If GUARD_PAGES is defined, a sample of small mallocs is placed at the end
+ * of a page of their own, followed by an inaccessible guard page, and freed
+ * ones are kept inaccessible for a while, so overflows and uses after free
+ * fault right away instead of corrupting the heap. One malloc in a thousand
+ * is sampled on average; mm_guard_sample changes the rate.
+ */
+// #define GUARD_PAGES // uncomment this line to enable sampled guard pages
+
 /* Basic constants */
 typedef uint64_t word_t;
 static const size_t wsize = sizeof(word_t);   // word and header size (bytes)
 static const size_t dsize = 2*sizeof(word_t);       // double word size (bytes)
 static const size_t min_block_size = 4*sizeof(word_t); // Minimum block size
 static const size_t chunksize = (1 << 12);    // requires (chunksize % 16 == 0)
+static const size_t max_chunksize = (1 << 18); // largest extension chosen by extend_chunk, a power of two times chunksize
+static const int max_chunk_log = 6; //log2 of max_chunksize / chunksize
 
 static const word_t alloc_mask = 0x1;
+static const word_t large_mask = 0x2; // block lives in its own large region
+static const word_t zero_mask = 0x4; // free block whose payload past the list links is known to be zero
+static const word_t idle_mask = 0x8; // free block seen by the last purge pass
+static const word_t movable_mask = 0x8; // allocated block mm_compact may move; idle_mask only applies to free blocks
+static const word_t tag_mask = 0x4; // tag word in front of an aligned payload inside a large block, its size is the distance back to the header; zero_mask only applies to free blocks
 static const word_t size_mask = ~(word_t)0xF;
 
 typedef struct block
@@ -90,34 +161,208 @@ typedef struct block
 	};
 } block_t;
 
+/* Entry of a fit window: a free block and its size, kept side by side so find_fit scans contiguous memory */
+typedef struct
+{
+    size_t size;
+    block_t* block;
+} fit_entry_t;
+
+/* Heap globals saved in the header page of a file-backed heap by mm_detach */
+typedef struct
+{
+    word_t magic; //heap_magic once a clean mm_detach has written everything below
+    word_t secret;
+    word_t canary;
+    block_t* start;
+    block_t* prol;
+    block_t* epil;
+    word_t* segments;
+#ifdef BOUNDED_LATENCY
+    block_t* free_list_start[49];
+    block_t* free_list_end[49];
+#else
+    block_t* free_list_start[13];
+    block_t* free_list_end[13];
+#endif
+    block_t* large_free_list[40];
+    void* root;
+} heap_state_t;
+
 
 /* Global variables */
 static block_t *heap_start = NULL; //Pointer to first block
 
 static block_t* heap_prol = NULL; //Pointers to heap prologue and epilogue
 static block_t* heap_epil = NULL; 
-
-static int seg_num = 3; //number of segregated lists
+static word_t* heap_segments = NULL; //prologue of the newest heap segment, which links to the one before (see extend_heap)
+
+#ifdef BOUNDED_LATENCY
+static int seg_num = 49; //four lists per power of two from 32 bytes to 128 KiB, the last one open-ended
+static block_t* all_free_list_start[49] = {NULL}; //Array of pointers to free list start and end blocks. The number inside brackets should match seg_num.
+static block_t* all_free_list_end[49] = {NULL};
+static word_t list_map = 0; //bit i is set while free list i holds a block
+static const int bounded_lists = 48; //lists below this one hold blocks of one quarter of a power of two
+static const int min_block_log = 5; //log2 of min_block_size, the base of the first list
+#else
+static int seg_num = 13; //number of segregated lists
+static block_t* all_free_list_start[13] = {NULL}; //Array of pointers to free list start and end blocks. The number inside brackets should match seg_num.
+static block_t* all_free_list_end[13] = {NULL};
 static int first_list = 0;
 static int second_list = 1;
 static int third_list = 2;
-static block_t* all_free_list_start[3] = {NULL}; //Array of pointers to free list start and end blocks. The number inside brackets should match seg_num.
-static block_t* all_free_list_end[3] = {NULL};
 
-static const size_t cat1 = 4*sizeof(word_t); //first size category: 32 bytes
-static const size_t cat2 =4*sizeof(word_t) * 1.5; //second size category: 64 - 96 bytes
-static const size_t cat3 = 4*sizeof(word_t) * 2; //third size category: 96 bytes and above
+static const size_t cat2 =4*sizeof(word_t) * 1.5; //second size category: 48 - 64 bytes
+static const size_t cat3 = 4*sizeof(word_t) * 2; //third size category: 64 - 128 bytes. Each later category doubles, the last one is open-ended
+static const int cat3_log = 6; //log2 of cat3
+
+static const int fit_window = 16; //most recently added blocks of each list mirrored in its fit window
+static fit_entry_t fit_entries[13][16]; //fit window of each free list. The numbers inside brackets should match seg_num and fit_window.
+static int fit_count[13] = {0}; //number of entries in each fit window
+static int fit_evict[13] = {0}; //next entry to overwrite when a fit window is full
+static bool fit_partial[13] = {false}; //true when a list may hold blocks that are not in its fit window
+#endif
 
 //static block_t* free_list_start_arr[] = { free_list1_start, free_list2_start, free_list3_start }; //array of pointers to segregated free lists' start and end blocks
 //static block_t* free_list_end_arr[] = { free_list1_end, free_list2_end, free_list3_end };
 
 
+#ifndef BOUNDED_LATENCY
 static int N = 20; //global variable for Nth fit in find_fit
+#endif
+
+static const unsigned long extend_window = 1024; //mallocs within which a class extending again counts as a burst
+#ifdef BOUNDED_LATENCY
+static size_t extend_size[49]; //current heap extension of each size class. The number inside brackets should match seg_num.
+static unsigned long extend_last[49]; //malloc_count at each class's last extension
+#else
+static size_t extend_size[13]; //current heap extension of each size class. The number inside brackets should match seg_num.
+static unsigned long extend_last[13]; //malloc_count at each class's last extension
+#endif
+static unsigned long malloc_count = 0; //calls to heap_malloc since mm_init
+static size_t extend_count = 0; //calls to extend_heap since mm_init
+static size_t free_count = 0; //calls to heap_free since mm_init
+static size_t fit_miss_count = 0; //calls to heap_malloc that extended the heap since mm_init
+static size_t merge_count = 0; //calls to coalesce that merged blocks since mm_init
+static _Atomic(size_t) grow_count = 0; //blocks grown in place by realloc since mm_init
+static _Atomic(size_t) copy_count = 0; //blocks moved by realloc since mm_init
+
+static word_t heap_secret = 0; //per-heap secret for encoded links (HARDENED only)
+static word_t canary_secret = 0; //per-heap secret for footer canaries, drawn apart so one never gives away the other (HARDENED only)
+static void* heap_root = NULL; //application root pointer, kept across restarts of a file-backed heap
+static const word_t heap_magic = 0x6d6d737461746501;
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER; //guards every global above and the heap itself
+static _Atomic(block_t*) remote_free_head = NULL; //blocks freed while heap_lock was held by another thread
+#ifdef BOUNDED_LATENCY
+static const int drain_batch = 8; //most remotely freed blocks one malloc releases
+#endif
+
+static const size_t large_size = (1 << 16); //requests of 64 KiB and above take the large block path
+static const size_t discard_size = (1 << 18); //calloc clears dirty ranges this big by discarding their pages
+static const int large_log = 16; //log2 of large_size, the base of the first large class
+static const int large_class_num = 40; //four classes per power of two, the last one holds everything from 64 MiB up
+static const int large_slack = 4; //larger classes large_malloc may take a cached block from, one power of two
+static block_t* large_free_list[40] = {NULL}; //LIFO lists of free large blocks. The number inside brackets should match large_class_num.
+static pthread_mutex_t large_lock[40] = { [0 ... 39] = PTHREAD_MUTEX_INITIALIZER }; //one lock per large class
+static size_t large_malloc_count[40] = {0}; //large blocks handed out per class since mm_init, counted under its lock
+static size_t large_free_count[40] = {0}; //large blocks freed per class since mm_init
+static const size_t large_cache_size = (size_t)1 << 25; //most bytes of free large blocks kept resident for reuse
+static _Atomic(size_t) large_cached = 0; //bytes of free large blocks on the large lists whose pages are still resident
+
+static const int purge_batch = 64; //most small blocks discarded per heap_lock hold
+static const int purge_scan = 1024; //most free blocks one pass looks at per lock hold, so a long list never stalls the lock
+static int purge_list = 0; //free list purge_heap resumes in
+static block_t* purge_cursor = NULL; //block of purge_list purge_heap looks at next, NULL for the list's first
+static block_t* large_purge_cursor[40] = {NULL}; //block of each large list in front of where purge_large resumes, NULL for its head
+static pthread_mutex_t purge_lock = PTHREAD_MUTEX_INITIALIZER; //guards the purge thread state below
+static pthread_cond_t purge_cond = PTHREAD_COND_INITIALIZER; //wakes the purge thread early to stop it
+static pthread_t purge_thread;
+static bool purge_running = false;
+static unsigned int purge_decay_ms = 0; //period between purge passes
+#ifndef DRIVER
+static _Atomic(unsigned int) purge_pending = 0; //period of a purge thread lazy_init still has to start, 0 for none
+#endif
+
+#ifdef GUARD_PAGES
+static const int guard_slots = 4096; //guarded blocks that can exist at once, live or in quarantine
+static const int guard_quarantine = 1024; //frees of guarded blocks before a freed page is reused
+static char *guard_area = NULL; //a data page and a guard page for each slot, outside the heap
+static size_t guard_area_size = 0;
+static int guard_next = 0; //slots below this one have been used
+static int guard_ring[4096]; //freed slots, oldest first. The number inside brackets should match guard_slots.
+static int guard_ring_head = 0;
+static int guard_ring_count = 0;
+static bool guard_live[4096]; //true while a slot holds an allocated block
+static _Atomic(unsigned int) guard_every = 1000; //average number of mallocs per guarded one, 0 for none
+static pthread_mutex_t guard_lock = PTHREAD_MUTEX_INITIALIZER; //guards the slots above
+static _Thread_local unsigned int guard_skip = 0; //mallocs this thread makes before the next sampled one
+static _Thread_local word_t guard_seed = 0; //state of this thread's sampling generator
+#endif
+
+#ifndef DRIVER
+static pthread_once_t init_once = PTHREAD_ONCE_INIT; //runs init_heap on the first allocation
+#endif
 
 bool mm_checkheap(int lineno);
 
 /* Function prototypes for internal helper routines */
+static void *allocate(size_t size, size_t *dirty);
+static void *heap_malloc(size_t size, size_t *dirty);
+static void heap_free(block_t *block);
+static bool heap_grow(block_t *block, size_t asize);
+static void remote_free_push(block_t *block);
+static void remote_free_drain(void);
+#ifdef BOUNDED_LATENCY
+static void remote_free_take(int n);
+#endif
+static void *large_malloc(size_t size, size_t *dirty);
+static void large_free(block_t *block);
+static block_t *large_take(int ind, size_t bsize);
+static bool large_grow(block_t *block, size_t bsize);
+static size_t large_round(size_t psize);
+static int large_class(size_t psize);
+static void write_region(char *bp, size_t size);
+static void large_lock_all(void);
+static void large_unlock_all(void);
+static block_t *slide_block(block_t *block, block_t *block_next);
+static word_t *segment_next(word_t *segment);
+static size_t purge_heap(void);
+static size_t purge_large(int ind);
+static size_t purge_block(block_t *block);
+static void *purge_main(void *arg);
+static void *aligned_malloc(size_t alignment, size_t size);
+#ifdef GUARD_PAGES
+static bool guard_owns(void *bp);
+static void *guard_malloc(size_t size, size_t *dirty);
+static void guard_free(void *bp);
+static void guard_reset(void);
+#endif
+static block_t *user_block(void *bp);
+static size_t user_size(void *bp);
+static void lazy_init(void);
+#ifndef DRIVER
+static void init_heap(void);
+static void fork_prepare(void);
+static void fork_parent(void);
+static void fork_child(void);
+#endif
+#ifdef HARDENED
+static void check_alloc_block(block_t *block);
+#endif
+static bool check_heap(int line);
+static void clear_stats(void);
+
+static void probe_malloc_entry(size_t size);
+static void probe_malloc_exit(size_t size, void *bp);
+static void probe_free(void *bp);
+static void probe_fit_miss(size_t asize);
+static void probe_extend_heap(size_t size, block_t *block);
+static void probe_coalesce(block_t *block, size_t size);
+static void probe_realloc_copy(void *ptr, void *newptr, size_t size);
+
 static block_t *extend_heap(size_t size);
+static size_t extend_chunk(size_t asize);
 static void place(block_t *block, size_t asize);
 static block_t *find_fit(size_t asize);
 static block_t *coalesce(block_t *block);
@@ -136,6 +381,11 @@ static bool get_alloc(block_t *block);
 static void write_header(block_t *block, size_t size, bool alloc);
 static void write_footer(block_t *block, size_t size, bool alloc);
 
+static bool get_zero(block_t *block);
+static void add_flags(block_t *block, word_t flags);
+static void zero_seam(block_t *block);
+static void clear_payload(void *bp, size_t len);
+
 static block_t *payload_to_header(void *bp);
 static void *header_to_payload(block_t *block);
 
@@ -143,6 +393,24 @@ static block_t *find_next(block_t *block);
 static word_t *find_prev_footer(block_t *block);
 static block_t *find_prev(block_t *block);
 
+static block_t *get_free_prev(block_t *block);
+static block_t *get_free_next(block_t *block);
+static void set_free_prev(block_t *block, block_t *prev);
+static void set_free_next(block_t *block, block_t *next);
+static word_t get_canary(void);
+static word_t new_heap_secret(void);
+#ifdef HARDENED
+static word_t link_key(void *slot);
+#endif
+#if defined(HARDENED) || defined(GUARD_PAGES)
+static void heap_corrupt(const char *msg, void *addr);
+#endif
+
+static int list_index(size_t size);
+#ifndef BOUNDED_LATENCY
+static void window_add(int ind, block_t* block);
+static void window_rem(int ind, block_t* block);
+#endif
 static void list_add(block_t* block, block_t* free_list_start, block_t* free_list_end, int ind);
 static void list_rem(block_t* block, block_t* free_list_start, block_t* free_list_end, int ind);
 static void add_to_free_list(block_t* block);
@@ -158,7 +426,28 @@ bool mm_init(void)
 	heap_start = NULL;
 	heap_prol = NULL;
 	heap_epil = NULL;
+	heap_segments = NULL;
 	clear_free_list();
+	heap_secret = new_heap_secret();
+	canary_secret = new_heap_secret();
+	heap_root = NULL;
+	atomic_store(&remote_free_head, NULL);
+	clear_stats();
+	int i;
+	for (i = 0; i < large_class_num; i++)
+	{
+		large_free_list[i] = NULL;
+		large_purge_cursor[i] = NULL;
+	}
+	atomic_store(&large_cached, 0);
+	for (i = 0; i < seg_num; i++)
+	{
+		extend_size[i] = chunksize;
+		extend_last[i] = -extend_window; //as if the last extension was a whole window ago
+	}
+#ifdef GUARD_PAGES
+	guard_reset();
+#endif
 
     // Create the initial empty heap 
     word_t *start = (word_t *)(mem_sbrk(2*wsize));
@@ -168,13 +457,14 @@ bool mm_init(void)
         return false;
     }
 
-    start[0] = pack(0, true);
+    start[0] = pack(0, true); // the first segment, linking to none
     start[1] = pack(0, true);
 
     // Heap starts with first "block header", currently the epilogue footer
     heap_start = (block_t *) &(start[1]);
 	heap_prol = (block_t*) & (start[0]);
 	heap_epil = heap_start;
+	heap_segments = start;
 
     // Extend the empty heap with a free block of chunksize bytes
     if (extend_heap(chunksize) == NULL)
@@ -184,13 +474,204 @@ bool mm_init(void)
     return true;
 }
 
+/*
+ * mm_attach: picks up the heap left in a file-backed heap by the last mm_detach, or creates a new one with
+ *            mm_init if there is none or the saved heap fails mm_checkheap. The saved state is invalidated
+ *            while the heap is in use, so a process that dies without mm_detach leaves nothing to attach to.
+ */
+bool mm_attach(void)
+{
+    heap_state_t* state = mem_root_area();
+
+    if (state == NULL || sizeof(heap_state_t) > mem_root_size() || state->magic != heap_magic)
+    {
+        mem_reset_brk(); // whatever a crashed process left behind is not a heap to build on
+        return mm_init();
+    }
+
+    heap_secret = state->secret;
+    canary_secret = state->canary;
+    heap_start = state->start;
+    heap_prol = state->prol;
+    heap_epil = state->epil;
+    heap_segments = state->segments;
+    memcpy(all_free_list_start, state->free_list_start, sizeof(all_free_list_start));
+    memcpy(all_free_list_end, state->free_list_end, sizeof(all_free_list_end));
+    memcpy(large_free_list, state->large_free_list, sizeof(large_free_list));
+    memset(large_purge_cursor, 0, sizeof(large_purge_cursor));
+    purge_cursor = NULL;
+    int i;
+    size_t cached = 0;
+    for (i = 0; i < large_class_num; i++)
+    {
+        block_t *block;
+        for (block = large_free_list[i]; block != NULL; block = get_free_next(block))
+        {
+            cached += get_zero(block) ? 0 : get_size(block);
+        }
+    }
+    atomic_store(&large_cached, cached);
+#ifdef BOUNDED_LATENCY
+    list_map = 0;
+#endif
+    for (i = 0; i < seg_num; i++) //fit windows start empty and refill as blocks are freed
+    {
+#ifdef BOUNDED_LATENCY
+        if (all_free_list_start[i] != NULL)
+        {
+            list_map |= (word_t)1 << i;
+        }
+#else
+        fit_count[i] = 0;
+        fit_evict[i] = 0;
+        fit_partial[i] = true;
+#endif
+        extend_size[i] = chunksize;
+        extend_last[i] = -extend_window;
+    }
+    clear_stats();
+    heap_root = state->root;
+    atomic_store(&remote_free_head, NULL);
+    state->magic = 0;
+
+    if ((void*)heap_prol != mem_heap_lo() || !mm_checkheap(__LINE__))
+    {
+        mem_reset_brk();
+        return mm_init();
+    }
+    return true;
+}
+
+/*
+ * mm_detach: saves the heap globals in the header page of a file-backed heap so mm_attach can restore them.
+ *            Call it once the application is done allocating, before mem_deinit.
+ */
+void mm_detach(void)
+{
+    heap_state_t* state = mem_root_area();
+
+    mm_purge_stop();
+    if (state == NULL || sizeof(heap_state_t) > mem_root_size())
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    remote_free_drain();
+    state->secret = heap_secret;
+    state->canary = canary_secret;
+    state->start = heap_start;
+    state->prol = heap_prol;
+    state->epil = heap_epil;
+    state->segments = heap_segments;
+    memcpy(state->free_list_start, all_free_list_start, sizeof(all_free_list_start));
+    memcpy(state->free_list_end, all_free_list_end, sizeof(all_free_list_end));
+    memcpy(state->large_free_list, large_free_list, sizeof(large_free_list));
+    state->root = heap_root;
+    state->magic = heap_magic;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * mm_set_root: records the pointer through which the application finds its data again after a restart.
+ */
+void mm_set_root(void *ptr)
+{
+    heap_root = ptr;
+}
+
+/*
+ * mm_get_root: returns the pointer last given to mm_set_root, or NULL for a new heap.
+ */
+void *mm_get_root(void)
+{
+    return heap_root;
+}
+
 /*
  * malloc: requests memory from the heap to be allocated and returns a pointer to the start address of the memory. 
  *              If the heap needs more memory, the heap is extended.
  */
 void *malloc(size_t size) 
 {
-    //dbg_ensures(mm_checkheap(__LINE__));
+    size_t dirty;
+    return allocate(size, &dirty);
+}
+
+/*
+ * free: returns the block to the heap. If another thread is holding the heap, the block is queued
+ *       for that thread to release instead of waiting for the lock.
+ */
+void free(void *bp)
+{
+    if (bp == NULL)
+    {
+        return;
+    }
+    probe_free(bp);
+
+#ifdef GUARD_PAGES
+    if (guard_owns(bp))
+    {
+        guard_free(bp);
+        return;
+    }
+#endif
+
+    block_t *block = user_block(bp);
+
+    if (block->header & large_mask)
+    {
+        large_free(block);
+        return;
+    }
+
+    if (pthread_mutex_trylock(&heap_lock) != 0)
+    {
+        remote_free_push(block);
+        return;
+    }
+    heap_free(block);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * allocate: body of malloc. Also reports through dirty how many leading payload bytes may be
+ *           non-zero, so calloc only clears memory that is not already known to be zero.
+ */
+static void *allocate(size_t size, size_t *dirty)
+{
+    void *bp = NULL;
+
+    lazy_init();
+    probe_malloc_entry(size);
+#ifdef GUARD_PAGES
+    if (guard_skip-- == 0)
+    {
+        bp = guard_malloc(size, dirty);
+    }
+#endif
+    if (bp == NULL && size >= large_size)
+    {
+        bp = large_malloc(size, dirty);
+    }
+    else if (bp == NULL)
+    {
+        pthread_mutex_lock(&heap_lock);
+        bp = heap_malloc(size, dirty);
+        pthread_mutex_unlock(&heap_lock);
+    }
+    probe_malloc_exit(size, bp);
+    return bp;
+}
+
+/*
+ * heap_malloc: allocates from the segregated lists, called with heap_lock held. Releases any remotely
+ *              freed blocks before searching the free lists so they can satisfy this request.
+ */
+static void *heap_malloc(size_t size, size_t *dirty)
+{
+    dbg_requires(mm_checkheap(__LINE__));
     size_t asize;      // Adjusted block size
     size_t extendsize; // Amount to extend heap if no fit is found
     block_t *block;
@@ -201,14 +682,17 @@ void *malloc(size_t size)
         mm_init();
     }
 
-    if (size == 0) // Ignore spurious request
-    {
-        //dbg_ensures(mm_checkheap(__LINE__));
-        return bp;
-    }
+#ifdef BOUNDED_LATENCY
+    remote_free_take(drain_batch);
+#else
+    remote_free_drain();
+#endif
+    malloc_count++;
 
-    // Adjust block size to include overhead and to meet alignment requirements
-    asize = round_up(size + dsize, dsize);
+    // Adjust block size to include overhead and to meet alignment requirements.
+    // A request for nothing still gets a unique block, as programs written against
+    // the C library's malloc take NULL for running out of memory
+    asize = max(round_up(size + dsize, dsize), min_block_size);
 
     // Search the free list for a fit
     block = find_fit(asize);
@@ -216,7 +700,9 @@ void *malloc(size_t size)
     // If no fit is found, request more memory, and then and place the block
     if (block == NULL)
     {  
-        extendsize = max(asize, chunksize);
+        fit_miss_count++;
+        probe_fit_miss(asize);
+        extendsize = max(asize, extend_chunk(asize));
         block = extend_heap(extendsize);
         if (block == NULL) // extend_heap returns an error
         {
@@ -225,30 +711,73 @@ void *malloc(size_t size)
 
     }
 
+    *dirty = get_zero(block) ? dsize : get_payload_size(block);
     place(block, asize);
     bp = header_to_payload(block);
-    //dbg_ensures(mm_checkheap(__LINE__));
+    dbg_ensures(mm_checkheap(__LINE__));
     return bp;
 } 
 
 /*
- * free: rewrites header and footer of the block to indicate the block is free, coalesces the block, than adds to global free list
+ * heap_free: rewrites header and footer of the block to indicate the block is free, coalesces the block, than adds to global free list.
+ *            Called with heap_lock held.
  */
-void free(void *bp)
+static void heap_free(block_t *block)
 {
-    if (bp == NULL)
-    {
-        return;
-    }
-
-    block_t *block = payload_to_header(bp);
     size_t size = get_size(block);
 
+#ifdef HARDENED
+    check_alloc_block(block);
+#endif
+
+    free_count++;
     write_header(block, size, false);
     write_footer(block, size, false);
 	add_to_free_list(block); //add freed block to the global free list
 
     coalesce(block);
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
+/*
+ * heap_grow: enlarges an allocated block in place to asize bytes by taking over the free block after it,
+ *            extending the heap first if the block is the last one. Called with heap_lock held.
+ *            Returns false and leaves the block unchanged if the space after it is not free or too small.
+ */
+static bool heap_grow(block_t *block, size_t asize)
+{
+    size_t csize = get_size(block);
+    block_t *block_next = find_next(block);
+
+    if (get_size(block_next) == 0) // epilogue: new memory will start right after the block
+    {
+        extend_heap(max(asize - csize, chunksize));
+        block_next = find_next(block);
+    }
+    if (get_alloc(block_next) || csize + get_size(block_next) < asize)
+    {
+        return false;
+    }
+
+    csize += get_size(block_next);
+    rem_from_free_list(block_next);
+    if ((csize - asize) >= min_block_size) // split off the rest as in place
+    {
+        write_header(block, asize, true);
+        write_footer(block, asize, true);
+        block_next = find_next(block);
+        write_header(block_next, csize-asize, false);
+        write_footer(block_next, csize-asize, false);
+        add_to_free_list(block_next);
+    }
+    else
+    {
+        write_header(block, csize, true);
+        write_footer(block, csize, true);
+    }
+    atomic_fetch_add_explicit(&grow_count, 1, memory_order_relaxed);
+    dbg_ensures(mm_checkheap(__LINE__));
+    return true;
 }
 
 /*
@@ -256,10 +785,16 @@ void free(void *bp)
  */
 void *realloc(void *ptr, size_t size)
 {
-    block_t *block = payload_to_header(ptr);
+    block_t *block;
     size_t copysize;
     void *newptr;
 
+    // If ptr is NULL, then equivalent to malloc
+    if (ptr == NULL)
+    {
+        return malloc(size);
+    }
+
     // If size == 0, then free block and return NULL
     if (size == 0)
     {
@@ -267,10 +802,38 @@ void *realloc(void *ptr, size_t size)
         return NULL;
     }
 
-    // If ptr is NULL, then equivalent to malloc
-    if (ptr == NULL)
+    // If the slack left by place already covers the new size, keep the block,
+    // unless that would pin down more than twice what the caller still needs
+    block = user_block(ptr);
+    copysize = user_size(ptr);
+    if (size <= copysize && size >= copysize / 2)
     {
-        return malloc(size);
+        return ptr;
+    }
+
+    // A small block can often grow into the free space after it, so the data need not move at all
+    if (size > copysize && size < large_size && !(block->header & large_mask) && header_to_payload(block) == ptr)
+    {
+        pthread_mutex_lock(&heap_lock);
+        bool grown = heap_grow(block, round_up(size + dsize, dsize));
+        pthread_mutex_unlock(&heap_lock);
+        if (grown)
+        {
+            return ptr;
+        }
+    }
+
+    // So can a large block at the break or in front of a free large region, rounded as large_malloc would.
+    // A guarded block carries large_mask too, but lives in no large region
+    bool large = (block->header & large_mask) != 0;
+#ifdef GUARD_PAGES
+    large = large && !guard_owns(ptr);
+#endif
+    if (size > copysize && size <= (size_t)1 << 62 && large && header_to_payload(block) == ptr
+        && large_grow(block, large_round(round_up(size, dsize)) + dsize))
+    {
+        atomic_fetch_add_explicit(&grow_count, 1, memory_order_relaxed);
+        return ptr;
     }
 
     // Otherwise, proceed with reallocation
@@ -282,12 +845,14 @@ void *realloc(void *ptr, size_t size)
     }
 
     // Copy the old data
-    copysize = get_payload_size(block); // gets size of old payload
+    copysize = user_size(ptr); // gets size of old payload
     if(size < copysize)
     {
         copysize = size;
     }
     memcpy(newptr, ptr, copysize);
+    atomic_fetch_add_explicit(&copy_count, 1, memory_order_relaxed);
+    probe_realloc_copy(ptr, newptr, copysize);
 
     // Free the old block
     free(ptr);
@@ -302,74 +867,1396 @@ void *calloc(size_t elements, size_t size)
 {
     void *bp;
     size_t asize = elements * size;
+    size_t dirty;
 
-    if (asize/elements != size)
+    if (elements != 0 && asize/elements != size)
     {    
         // Multiplication overflowed
+        errno = ENOMEM;
         return NULL;
     }
     
-    bp = malloc(asize);
+    bp = allocate(asize, &dirty);
     if (bp == NULL)
     {
         return NULL;
     }
-    // Initialize all bits to 0
-    memset(bp, 0, asize);
+    // Initialize all bits to 0, skipping whatever the block already guarantees
+    clear_payload(bp, (dirty < asize) ? dirty : asize);
 
     return bp;
 }
 
-/******** Helper and debug routines ********/
-
 /*
- * extend_heap: requests additional memory for the heap. The free block is the legal size of a block that can contain length "size".
- * Then, it creates the free block header/footer, the new epilogue header, and coalesces the free block.
+ * malloc_usable_size: returns how many bytes the caller may use at ptr, which can exceed the size
+ *                     it asked for by whatever slack place could not split off.
  */
-static block_t *extend_heap(size_t size) 
+size_t malloc_usable_size(void *ptr)
 {
-    void *bp;
-
-    // Allocate an even number of words to maintain alignment
-    size = round_up(size, dsize);
-    if ((bp = mem_sbrk(size)) == (void *)-1)
+    if (ptr == NULL)
     {
-        return NULL;
+        return 0;
     }
+    return user_size(ptr);
+}
 
-	heap_epil = (block_t*)((char*)heap_epil + size);
+/*
+ * malloc_with_size: allocates like malloc and stores the usable size of the new block in *usable,
+ *                   so growable buffers can fill the slack before they need to realloc.
+ */
+void *malloc_with_size(size_t size, size_t *usable)
+{
+    size_t dirty;
+    void *bp = allocate(size, &dirty);
 
-    // Initialize free block header/footer 
-    block_t *block = payload_to_header(bp);
-    write_header(block, size, false);
-    write_footer(block, size, false);
-	add_to_free_list(block); // Add freed block to global free list
+    *usable = (bp == NULL) ? 0 : get_payload_size(payload_to_header(bp));
+    return bp;
+}
 
-    // Create new epilogue header
-    block_t *block_next = find_next(block);
-    write_header(block_next, 0, true);
+/*
+ * posix_memalign: allocates size bytes at a multiple of alignment, which must be a power of two
+ *                 and a multiple of sizeof(void *), and stores the payload in *memptr.
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+    {
+        return EINVAL;
+    }
+    void *bp = aligned_malloc(alignment, size);
+    if (bp == NULL)
+    {
+        return ENOMEM;
+    }
+    *memptr = bp;
+    return 0;
+}
 
-    // Coalesce in case the previous block was free
-    return coalesce(block);
+/*
+ * aligned_alloc: allocates size bytes at a multiple of alignment, which must be a power of two.
+ */
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    return aligned_malloc(alignment, size);
 }
 
 /*
- * coalesce: combines any adjacent free blocks into one large free block.
+ * memalign: obsolete spelling of aligned_alloc.
  */
-static block_t *coalesce(block_t * block) 
+void *memalign(size_t alignment, size_t size)
 {
-	// first check that the block itself isn't allocated
-	if (get_alloc(block))
-	{
-		return block;
-	}
+    return aligned_alloc(alignment, size);
+}
 
-	block_t* coa_block = NULL; //the coalesced block to return
-	word_t* block_prev_footer = find_prev_footer(block);
-	word_t* block_next_header = (word_t*)((char*)block + get_size(block));
+/*
+ * valloc: allocates size bytes at the start of a page.
+ */
+void *valloc(size_t size)
+{
+    return aligned_malloc(mem_pagesize(), size);
+}
+
+/*
+ * pvalloc: allocates whole pages, at least size bytes, at the start of a page.
+ */
+void *pvalloc(size_t size)
+{
+    size_t page = mem_pagesize();
+    if (size > (size_t)-1 - page)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return aligned_malloc(page, round_up(size, page));
+}
+
+/*
+ * reallocarray: reallocates ptr to hold an array of elements of the given size, failing instead
+ *               of wrapping around when the product overflows.
+ */
+void *reallocarray(void *ptr, size_t elements, size_t size)
+{
+    size_t asize = elements * size;
+
+    if (elements != 0 && asize/elements != size)
+    {
+        // Multiplication overflowed
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, asize);
+}
+
+/*
+ * mm_malloc_movable: allocates a block mm_compact may relocate. *handle is set to the payload and updated on
+ *                    every move, so the caller must always reach the block through it and must not keep the
+ *                    handle itself inside a movable block. Release the block with mm_free_movable.
+ *                    The block records the handle's address, so on a file-backed heap the handle must live
+ *                    in the heap itself, where it is found again after mm_attach; any other handle fails
+ *                    with EINVAL.
+ */
+void *mm_malloc_movable(size_t size, void **handle)
+{
+    size_t dirty;
+    void *bp;
+
+    if (size > (size_t)1 << 62) // size + dsize must not wrap
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    lazy_init();
+    if (mem_root_area() != NULL && !mem_in_heap(handle, sizeof(*handle))) // a stack or static handle is gone after a restart
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    pthread_mutex_lock(&heap_lock);
+    bp = heap_malloc(size + dsize, &dirty); // movable blocks stay in the heap whatever their size
+    if (bp != NULL)
+    {
+        block_t *block = payload_to_header(bp);
+        add_flags(block, movable_mask);
+        *(void ***)bp = handle;
+        bp = (char *)bp + dsize;
+        *handle = bp;
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return bp;
+}
+
+/*
+ * mm_free_movable: frees a block allocated by mm_malloc_movable through its handle. The handle is read and
+ *                  the block freed under heap_lock, never through the remote free queue, so a compaction
+ *                  cannot move the block out from under the free.
+ */
+void mm_free_movable(void **handle)
+{
+    pthread_mutex_lock(&heap_lock);
+    if (*handle != NULL)
+    {
+        heap_free(payload_to_header((char *)*handle - dsize));
+        *handle = NULL;
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * mm_compact: slides movable blocks down into the free blocks in front of them, so the holes between
+ *             long-lived blocks merge, then discards the whole pages of the holes that remain, including
+ *             the free block at the top of the heap. Only the heap segments are walked, under heap_lock
+ *             alone; holes are discarded in batches with the lock released, as purge_heap does.
+ *             Other threads may keep allocating, but must not touch movable blocks until it returns.
+ *             Returns the number of bytes handed back to the system.
+ */
+size_t mm_compact(void)
+{
+    block_t *batch[64]; //the number inside brackets should match purge_batch
+    size_t sizes[64];
+    word_t *segment;
+    block_t *block;
+    size_t purged = 0;
+    size_t batch_purged;
+    int n;
+    int i;
+
+    pthread_mutex_lock(&heap_lock);
+    if (heap_start == NULL)
+    {
+        pthread_mutex_unlock(&heap_lock);
+        return 0;
+    }
+    remote_free_drain();
+
+    do
+    {
+        n = 0;
+        for (segment = heap_segments; segment != NULL && n < purge_batch; segment = segment_next(segment))
+        {
+            block = (block_t *)(segment + 1); // first block after the segment's prologue
+            while (get_size(block) != 0 && n < purge_batch)
+            {
+                if (!get_alloc(block))
+                {
+                    block_t *block_next = find_next(block);
+                    if (get_alloc(block_next) && (block_next->header & movable_mask))
+                    {
+                        block = slide_block(block, block_next); // look again at the hole it leaves
+                        continue;
+                    }
+
+                    // Nothing left to slide into this hole: take it off the lists to hand its whole pages back
+                    size_t size = get_size(block);
+                    if (!get_zero(block) && size >= 2*mem_pagesize())
+                    {
+                        rem_from_free_list(block);
+                        write_header(block, size, true);
+                        write_footer(block, size, true);
+                        batch[n++] = block;
+                    }
+                }
+                block = find_next(block);
+            }
+        }
+        pthread_mutex_unlock(&heap_lock);
+
+        batch_purged = 0;
+        for (i = 0; i < n; i++)
+        {
+            sizes[i] = purge_block(batch[i]);
+            batch_purged += sizes[i];
+        }
+
+        pthread_mutex_lock(&heap_lock);
+        for (i = 0; i < n; i++)
+        {
+            size_t size = get_size(batch[i]);
+            write_header(batch[i], size, false);
+            write_footer(batch[i], size, false);
+            if (sizes[i] > 0)
+            {
+                add_flags(batch[i], zero_mask);
+            }
+            add_to_free_list(batch[i]);
+            coalesce(batch[i]);
+        }
+        purged += batch_purged;
+    } while (n == purge_batch && batch_purged > 0); // a full batch may have left holes behind it
+    pthread_mutex_unlock(&heap_lock);
+    return purged;
+}
+
+/*
+ * mm_reserve: grows the heap by at least size bytes and faults in their pages, so mallocs can be served
+ *             from them without a system call or a page fault. Returns false if the heap cannot grow.
+ */
+bool mm_reserve(size_t size)
+{
+    size_t page = mem_pagesize();
+    block_t *block;
+
+    lazy_init();
+    pthread_mutex_lock(&heap_lock);
+    if (heap_start == NULL)
+    {
+        mm_init();
+    }
+    block = extend_heap(size);
+    if (block != NULL)
+    {
+        // Writing zeros leaves the payload as it was, known zero or not, but makes the kernel back every page now
+        char *p = (char *)round_up((size_t)block->payload + dsize, page);
+        char *end = (char *)block + get_size(block) - wsize;
+        for (; p < end; p += page)
+        {
+            *p = 0;
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return block != NULL;
+}
+
+/*
+ * mm_extend_count: returns how many times the heap has been extended since mm_init.
+ */
+size_t mm_extend_count(void)
+{
+    return extend_count;
+}
+
+/*
+ * mm_stats: fills in stats with the event counts since mm_init. Each group of counters is read under the
+ *           lock it is counted under, so the totals are exact, though not all taken at the same instant.
+ */
+void mm_stats(mm_stats_t *stats)
+{
+    int i;
+
+    pthread_mutex_lock(&heap_lock);
+    stats->mallocs = malloc_count;
+    stats->frees = free_count;
+    stats->fit_misses = fit_miss_count;
+    stats->extends = extend_count;
+    stats->merges = merge_count;
+    stats->grows = atomic_load_explicit(&grow_count, memory_order_relaxed);
+    pthread_mutex_unlock(&heap_lock);
+    stats->copies = atomic_load_explicit(&copy_count, memory_order_relaxed);
+
+    stats->large_mallocs = 0;
+    stats->large_frees = 0;
+    for (i = 0; i < large_class_num; i++)
+    {
+        pthread_mutex_lock(&large_lock[i]);
+        stats->large_mallocs += large_malloc_count[i];
+        stats->large_frees += large_free_count[i];
+        pthread_mutex_unlock(&large_lock[i]);
+    }
+}
+
+/*
+ * mm_purge: runs one purge pass over the heap and the large lists. Blocks flagged idle by the previous
+ *           pass have their interior pages discarded; every other purgeable block is flagged idle.
+ *           Returns the number of bytes handed back to the system.
+ */
+size_t mm_purge(void)
+{
+    size_t purged = purge_heap();
+    int i;
+    for (i = 0; i < large_class_num; i++)
+    {
+        purged += purge_large(i);
+    }
+    return purged;
+}
+
+/*
+ * mm_purge_start: starts a background thread that calls mm_purge every decay_ms milliseconds, so a free
+ *                 block is released once it has been idle for between one and two periods.
+ */
+bool mm_purge_start(unsigned int decay_ms)
+{
+    bool ok = true;
+
+    pthread_mutex_lock(&purge_lock);
+    purge_decay_ms = decay_ms;
+    if (!purge_running)
+    {
+        purge_running = true;
+        if (pthread_create(&purge_thread, NULL, purge_main, NULL) != 0)
+        {
+            purge_running = false;
+            ok = false;
+        }
+    }
+    pthread_mutex_unlock(&purge_lock);
+    return ok;
+}
+
+/*
+ * mm_purge_stop: stops the background purge thread and waits for it to exit.
+ */
+void mm_purge_stop(void)
+{
+    pthread_mutex_lock(&purge_lock);
+    if (!purge_running)
+    {
+        pthread_mutex_unlock(&purge_lock);
+        return;
+    }
+    purge_running = false;
+    pthread_cond_signal(&purge_cond);
+    pthread_mutex_unlock(&purge_lock);
+    pthread_join(purge_thread, NULL);
+}
+
+/*
+ * mm_guard_sample: sets how many mallocs there are per guarded one on average, 0 to guard none.
+ *                  Each thread picks up the new rate after its next sampled malloc.
+ *                  Does nothing unless GUARD_PAGES is defined.
+ */
+void mm_guard_sample(unsigned int every)
+{
+#ifdef GUARD_PAGES
+    atomic_store_explicit(&guard_every, every, memory_order_relaxed);
+    guard_skip = 0;
+#endif
+}
+
+/******** Helper and debug routines ********/
+
+/*
+ * aligned_malloc: allocates size bytes at a multiple of alignment, a power of two. A small request takes a block
+ *                 with room for the alignment and a free block in front, then frees what lies before and after
+ *                 the aligned block. A large one places the payload inside a large block behind a tag word.
+ */
+static void *aligned_malloc(size_t alignment, size_t size)
+{
+    size_t dirty;
+    char *bp;
+
+    if (alignment <= dsize)
+    {
+        return malloc(size);
+    }
+    if (size > (size_t)1 << 62 || alignment > (size_t)1 << 62) // keep the sums below from overflowing
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    lazy_init();
+
+    if (size + alignment + min_block_size >= large_size)
+    {
+        bp = large_malloc(size + alignment, &dirty);
+        if (bp == NULL)
+        {
+            return NULL;
+        }
+        block_t *block = payload_to_header(bp);
+        char *abp = (char *)round_up((size_t)bp + wsize, alignment);
+        payload_to_header(abp)->header = pack(abp - wsize - (char *)block, true) | tag_mask;
+        return abp;
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    bp = heap_malloc(size + alignment + min_block_size, &dirty);
+    if (bp == NULL)
+    {
+        pthread_mutex_unlock(&heap_lock);
+        return NULL;
+    }
+    block_t *block = payload_to_header(bp);
+    char *abp = (char *)round_up((size_t)bp + min_block_size, alignment);
+    block_t *ablock = payload_to_header(abp);
+    size_t asize = max(round_up(size + dsize, dsize), min_block_size);
+    size_t lead = (char *)ablock - (char *)block;
+    size_t rest = get_size(block) - lead;
+
+    write_header(block, lead, true);
+    write_footer(block, lead, true);
+    if ((rest - asize) >= min_block_size) // free the tail as well
+    {
+        write_header(ablock, asize, true);
+        write_footer(ablock, asize, true);
+        block_t *block_next = find_next(ablock);
+        write_header(block_next, rest - asize, true);
+        write_footer(block_next, rest - asize, true);
+        heap_free(block_next);
+    }
+    else
+    {
+        write_header(ablock, rest, true);
+        write_footer(ablock, rest, true);
+    }
+    heap_free(block);
+    pthread_mutex_unlock(&heap_lock);
+    return abp;
+}
+
+/*
+ * user_block: returns the block holding a payload handed out by malloc or aligned_malloc, following
+ *             the tag word in front of an aligned payload inside a large block.
+ */
+static block_t *user_block(void *bp)
+{
+    block_t *block = payload_to_header(bp);
+    if (block->header & tag_mask)
+    {
+        block = (block_t *)((char *)block - get_size(block));
+    }
+    return block;
+}
+
+/*
+ * user_size: returns how many bytes the caller may use at a payload handed out by malloc or aligned_malloc.
+ */
+static size_t user_size(void *bp)
+{
+    block_t *block = user_block(bp);
+    return get_payload_size(block) - ((char *)bp - (char *)header_to_payload(block));
+}
+
+/*
+ * lazy_init: when this file replaces the system malloc, nothing calls mem_init and mm_init before the first
+ *            allocation, so that allocation does, exactly once across threads. The driver calls both itself.
+ *            A purge thread asked for by init_heap or fork_child is started here, outside pthread_once,
+ *            since creating a thread may allocate.
+ */
+static void lazy_init(void)
+{
+#ifndef DRIVER
+    pthread_once(&init_once, init_heap);
+    if (atomic_load_explicit(&purge_pending, memory_order_relaxed) != 0)
+    {
+        unsigned int decay_ms = atomic_exchange(&purge_pending, 0);
+        if (decay_ms != 0)
+        {
+            mm_purge_start(decay_ms);
+        }
+    }
+#endif
+}
+#ifndef DRIVER
+/*
+ * init_heap: maps the heap, creates it, reads the MM_ settings from the environment, and registers the fork
+ *            handlers. Run once by lazy_init.
+ */
+static void init_heap(void)
+{
+    mem_init();
+    mm_init();
+#ifdef GUARD_PAGES
+    const char *every = getenv("MM_GUARD_SAMPLE"); // a preloaded program cannot call mm_guard_sample
+    if (every != NULL)
+    {
+        mm_guard_sample(strtoul(every, NULL, 10));
+    }
+#endif
+    const char *decay = getenv("MM_PURGE_DECAY_MS"); // likewise for mm_purge_start
+    if (decay != NULL)
+    {
+        atomic_store(&purge_pending, (unsigned int)strtoul(decay, NULL, 10));
+    }
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+/*
+ * fork_prepare: takes every allocator lock before fork, outermost first, so no lock is copied into
+ *               the child while another thread is halfway through changing the heap.
+ */
+static void fork_prepare(void)
+{
+    pthread_mutex_lock(&purge_lock);
+    pthread_mutex_lock(&heap_lock);
+#ifdef GUARD_PAGES
+    pthread_mutex_lock(&guard_lock);
+#endif
+    large_lock_all();
+    mem_lock();
+}
+
+/*
+ * fork_parent: releases the locks taken by fork_prepare in the parent.
+ */
+static void fork_parent(void)
+{
+    mem_unlock();
+    large_unlock_all();
+#ifdef GUARD_PAGES
+    pthread_mutex_unlock(&guard_lock);
+#endif
+    pthread_mutex_unlock(&heap_lock);
+    pthread_mutex_unlock(&purge_lock);
+}
+
+/*
+ * fork_child: releases the locks taken by fork_prepare in the child, where the purge thread does not exist.
+ *             A purge thread the parent ran is started again by the child's next allocation.
+ */
+static void fork_child(void)
+{
+    if (purge_running)
+    {
+        atomic_store(&purge_pending, purge_decay_ms);
+    }
+    purge_running = false;
+    fork_parent();
+}
+#endif
+
+#ifdef GUARD_PAGES
+/*
+ * guard_owns: returns true if bp lies in the guard area, so it was handed out by guard_malloc.
+ */
+static bool guard_owns(void *bp)
+{
+    return (size_t)bp - (size_t)guard_area < guard_area_size;
+}
+
+/*
+ * guard_malloc: places a block of size bytes at the end of the data page of a guard slot, right in front of
+ *               its guard page, if the request fits in a page and a slot is free. Slots never used come first,
+ *               then the one freed longest ago, once guard_quarantine others have been freed after it.
+ *               Also draws how many mallocs this thread makes before the next sampled one.
+ *               Returns NULL to leave the request to the heap.
+ */
+static void *guard_malloc(size_t size, size_t *dirty)
+{
+    size_t page = mem_pagesize();
+    size_t psize = max(round_up(size, dsize), dsize);
+    unsigned int every = atomic_load_explicit(&guard_every, memory_order_relaxed);
+    bool first = (guard_seed == 0); // a thread's first malloc only draws its first skip
+    int slot;
+
+    if (first)
+    {
+        guard_seed = ((word_t)&guard_seed ^ heap_secret) | 1;
+    }
+    guard_seed ^= guard_seed << 13; // xorshift, so sampled mallocs do not line up with loops in the program
+    guard_seed ^= guard_seed >> 7;
+    guard_seed ^= guard_seed << 17;
+    guard_skip = (every == 0) ? (unsigned int)-1 : (unsigned int)(guard_seed % (2*(word_t)every));
+
+    if (first || every == 0 || guard_area == NULL || psize > page - dsize)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&guard_lock);
+    if (guard_next < guard_slots)
+    {
+        slot = guard_next++;
+    }
+    else if (guard_ring_count > guard_quarantine)
+    {
+        slot = guard_ring[guard_ring_head];
+        guard_ring_head = (guard_ring_head + 1) % guard_slots;
+        guard_ring_count--;
+    }
+    else
+    {
+        pthread_mutex_unlock(&guard_lock);
+        return NULL;
+    }
+
+    char *data = guard_area + (size_t)slot * 2*page;
+    if (!mem_protect(data, page, true))
+    {
+        guard_ring[(guard_ring_head + guard_ring_count++) % guard_slots] = slot; // try it again later
+        pthread_mutex_unlock(&guard_lock);
+        return NULL;
+    }
+    guard_live[slot] = true;
+    pthread_mutex_unlock(&guard_lock);
+
+    // large_mask keeps realloc from growing the block into the guard page
+    char *bp = data + page - psize;
+    payload_to_header(bp)->header = pack(psize + dsize, true) | large_mask;
+    *dirty = 0; // a page just opened reads as zero
+    return bp;
+}
+
+/*
+ * guard_free: closes the data page of a guarded block and queues its slot for reuse. Freeing a slot that is
+ *             not live, or a pointer that is not its payload, is reported like other heap corruption.
+ */
+static void guard_free(void *bp)
+{
+    size_t page = mem_pagesize();
+    int slot = (int)(((char *)bp - guard_area) / (2*page));
+    char *data = guard_area + (size_t)slot * 2*page;
+
+    pthread_mutex_lock(&guard_lock);
+    if (!guard_live[slot])
+    {
+        heap_corrupt("double free of guarded block", bp);
+    }
+    if ((char *)bp != data + page - get_payload_size(payload_to_header(bp)))
+    {
+        heap_corrupt("invalid pointer into guarded block", bp);
+    }
+    guard_live[slot] = false;
+    mem_protect(data, page, false);
+    guard_ring[(guard_ring_head + guard_ring_count++) % guard_slots] = slot;
+    pthread_mutex_unlock(&guard_lock);
+}
+
+/*
+ * guard_reset: called by mm_init. Maps the guard area the first time, and afterwards closes every slot
+ *              used by the previous heap and makes them all new again. A heap in a file gets no guard area,
+ *              since its blocks must be in the file to outlive the process.
+ */
+static void guard_reset(void)
+{
+    size_t page = mem_pagesize();
+
+    pthread_mutex_lock(&guard_lock);
+    if (guard_area == NULL && mem_root_area() == NULL)
+    {
+        guard_area = mem_reserve_area((size_t)guard_slots * 2*page);
+        guard_area_size = (guard_area == NULL) ? 0 : (size_t)guard_slots * 2*page;
+    }
+    else if (guard_next > 0)
+    {
+        mem_protect(guard_area, (size_t)guard_next * 2*page, false);
+    }
+    guard_next = 0;
+    guard_ring_head = 0;
+    guard_ring_count = 0;
+    memset(guard_live, 0, sizeof(guard_live));
+    pthread_mutex_unlock(&guard_lock);
+}
+#endif
+
+/*
+ * remote_free_push: queues an allocated block for release by the thread holding heap_lock.
+ *                   The block keeps its allocated header until drained, so neighbours never coalesce into it;
+ *                   the queue link reuses the payload word that holds free_next once the block is free.
+ */
+static void remote_free_push(block_t *block)
+{
+    block_t *head = atomic_load_explicit(&remote_free_head, memory_order_relaxed);
+    do
+    {
+        set_free_next(block, head);
+    } while (!atomic_compare_exchange_weak_explicit(&remote_free_head, &head, block,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+/*
+ * remote_free_drain: takes the whole remote free queue in one exchange and frees every block on it.
+ *                    Called with heap_lock held.
+ */
+static void remote_free_drain(void)
+{
+    if (atomic_load_explicit(&remote_free_head, memory_order_relaxed) == NULL)
+    {
+        return;
+    }
+
+    block_t *block = atomic_exchange_explicit(&remote_free_head, NULL, memory_order_acquire);
+    while (block != NULL)
+    {
+        block_t *block_next = get_free_next(block); // read before heap_free reuses the link
+        heap_free(block);
+        block = block_next;
+    }
+}
+
+#ifdef BOUNDED_LATENCY
+/*
+ * remote_free_take: frees at most n blocks from the remote free queue, popping them one CAS at a time,
+ *                   so a malloc never pays for a long queue at once. Called with heap_lock held; no other
+ *                   thread pops, so the link of the block at the head cannot change before the CAS.
+ */
+static void remote_free_take(int n)
+{
+    block_t *block = atomic_load_explicit(&remote_free_head, memory_order_acquire);
+    while (n > 0 && block != NULL)
+    {
+        if (atomic_compare_exchange_weak_explicit(&remote_free_head, &block, get_free_next(block),
+                                                  memory_order_acquire, memory_order_acquire))
+        {
+            heap_free(block);
+            block = atomic_load_explicit(&remote_free_head, memory_order_acquire);
+            n--;
+        }
+    }
+}
+#endif
+
+/*
+ * large_malloc: allocates a block of at least large_size bytes without taking heap_lock. A free block of the
+ *               same class is reused if one is cached, or else one of the next large_slack classes, which is
+ *               less than twice as big; otherwise a new region is carved from memlib.
+ */
+static void *large_malloc(size_t size, size_t *dirty)
+{
+    if (size > (size_t)1 << 62) // keep the rounding below from overflowing
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Classes are chosen by payload, so a power of two request gets a block with no slack
+    size_t psize = large_round(max(round_up(size, dsize), large_size));
+    size_t bsize = psize + dsize;
+    int ind = large_class(psize);
+    block_t *block = NULL;
+    int c;
+
+    for (c = ind; c < large_class_num && c <= ind + large_slack; c++)
+    {
+        pthread_mutex_lock(&large_lock[c]);
+        block = large_take(c, bsize);
+        if (block != NULL)
+        {
+            break;
+        }
+        pthread_mutex_unlock(&large_lock[c]);
+    }
+
+    // Carve a new region under the class lock, so mm_compact never walks into one half written
+    if (block == NULL)
+    {
+        c = ind;
+        pthread_mutex_lock(&large_lock[c]);
+        char *bp = mem_sbrk(bsize + dsize);
+        if (bp == (void *)-1)
+        {
+            pthread_mutex_unlock(&large_lock[c]);
+            return NULL;
+        }
+        write_region(bp, bsize + dsize);
+        block = (block_t*)(bp + wsize);
+        *dirty = mem_sbrk_fresh(bp) ? 0 : bsize - dsize;
+    }
+    else
+    {
+        bsize = get_size(block);
+        *dirty = get_zero(block) ? dsize : bsize - dsize;
+        if (!get_zero(block))
+        {
+            atomic_fetch_sub_explicit(&large_cached, bsize, memory_order_relaxed);
+        }
+    }
+
+    block->header = pack(bsize, true) | large_mask;
+    *(word_t*)((char*)block + bsize - wsize) = block->header ^ get_canary();
+    large_malloc_count[c]++;
+    pthread_mutex_unlock(&large_lock[c]);
+    return header_to_payload(block);
+}
+
+/*
+ * large_take: removes and returns the first block of at least bsize bytes from large list ind, or NULL if
+ *             there is none. Every block fits unless this is the open-ended last class.
+ *             Called with large_lock[ind] held.
+ */
+static block_t *large_take(int ind, size_t bsize)
+{
+    block_t *block_prev = NULL;
+    block_t *block;
+
+    for (block = large_free_list[ind]; block != NULL; block = get_free_next(block))
+    {
+        if (get_size(block) >= bsize)
+        {
+            if (block_prev == NULL)
+            {
+                large_free_list[ind] = get_free_next(block);
+            }
+            else
+            {
+                set_free_next(block_prev, get_free_next(block));
+            }
+            if (block == large_purge_cursor[ind])
+            {
+                large_purge_cursor[ind] = block_prev; // purge_large resumes behind the block instead
+            }
+            return block;
+        }
+        block_prev = block;
+    }
+    return NULL;
+}
+
+/*
+ * large_grow: enlarges an allocated large block in place to at least bsize bytes. If its region is the last
+ *             range memlib handed out, the break moves and the region grows by what the block needs. Otherwise,
+ *             if the region right behind it holds a free large block no more than twice the size needed, the
+ *             block takes over that whole region, the epilogue and prologue in between included. Either way
+ *             the header is rewritten under a class lock, so mm_checkheap never reads it half done.
+ *             Returns false and leaves the block unchanged if neither works.
+ */
+static bool large_grow(block_t *block, size_t bsize)
+{
+    size_t csize = get_size(block);
+    char *end = (char *)block + csize + wsize; // end of the block's region, past its epilogue
+    block_t *block_next = (block_t *)(end + wsize); // header of the next region's block, if a region follows
+    size_t need = bsize - csize - dsize; // bytes the next region's block must have, after the two tags go
+    int ind = large_class(csize - dsize);
+    int last = large_class(max(2*need, large_size + dsize) - dsize);
+    int c;
+
+    pthread_mutex_lock(&large_lock[ind]);
+    if (mem_sbrk_at(end, bsize - csize) != (void *)-1)
+    {
+        block->header = pack(bsize, true) | large_mask;
+        *(word_t*)((char*)block + bsize - wsize) = block->header ^ get_canary();
+        *(word_t*)((char*)block + bsize) = pack(0, true); // the region's new epilogue
+        pthread_mutex_unlock(&large_lock[ind]);
+        return true;
+    }
+    pthread_mutex_unlock(&large_lock[ind]);
+
+    // A free block on a large list is whole, so finding block_next there proves a region starts at it
+    for (c = large_class(max(need, large_size + dsize) - dsize); c <= last; c++)
+    {
+        block_t *block_prev = NULL;
+        block_t *cur;
+        int scanned = 0;
+
+        pthread_mutex_lock(&large_lock[c]);
+        for (cur = large_free_list[c]; cur != NULL && cur != block_next && scanned < purge_scan; cur = get_free_next(cur))
+        {
+            block_prev = cur;
+            scanned++;
+        }
+        if (cur == block_next && get_size(cur) >= need && get_size(cur) <= 2*need)
+        {
+            size_t nsize = get_size(cur);
+            if (block_prev == NULL)
+            {
+                large_free_list[c] = get_free_next(cur);
+            }
+            else
+            {
+                set_free_next(block_prev, get_free_next(cur));
+            }
+            if (cur == large_purge_cursor[c])
+            {
+                large_purge_cursor[c] = block_prev;
+            }
+            if (!get_zero(cur))
+            {
+                atomic_fetch_sub_explicit(&large_cached, nsize, memory_order_relaxed);
+            }
+            bsize = csize + dsize + nsize;
+            block->header = pack(bsize, true) | large_mask;
+            *(word_t*)((char*)block + bsize - wsize) = block->header ^ get_canary();
+            pthread_mutex_unlock(&large_lock[c]);
+            return true;
+        }
+        pthread_mutex_unlock(&large_lock[c]);
+        if (cur == block_next)
+        {
+            return false; // found, but the wrong size
+        }
+    }
+    return false;
+}
+
+/*
+ * large_free: returns a large block to the free list of its class. Regions are never merged, so the
+ *             block keeps its size and only its alloc bit changes. Once the free large blocks hold
+ *             large_cache_size resident bytes, the block's pages are discarded before it is listed,
+ *             while it still belongs to the caller, so no lock is held across the system call.
+ */
+static void large_free(block_t *block)
+{
+    size_t bsize = get_size(block);
+    int ind = large_class(bsize - dsize);
+    bool zero;
+
+#ifdef HARDENED
+    check_alloc_block(block);
+#endif
+
+    zero = atomic_fetch_add_explicit(&large_cached, bsize, memory_order_relaxed) + bsize > large_cache_size
+        && purge_block(block) > 0;
+    if (zero)
+    {
+        atomic_fetch_sub_explicit(&large_cached, bsize, memory_order_relaxed);
+    }
+
+    pthread_mutex_lock(&large_lock[ind]); // mm_checkheap never sees the header and footer disagree
+    block->header = pack(bsize, false) | large_mask | (zero ? zero_mask : 0);
+    *(word_t*)((char*)block + bsize - wsize) = block->header;
+    set_free_next(block, large_free_list[ind]);
+    large_free_list[ind] = block;
+    large_free_count[ind]++;
+    pthread_mutex_unlock(&large_lock[ind]);
+}
+
+/*
+ * large_round: rounds a large payload size up to the next class boundary, a quarter of the power of two below it,
+ *              so any free block of a class can serve any request of that class.
+ */
+static size_t large_round(size_t psize)
+{
+    int log = 63 - __builtin_clzl(psize);
+    return round_up(psize, (size_t)1 << (log - 2));
+}
+
+/*
+ * large_class: returns the index of the large free list holding blocks with psize payload bytes.
+ */
+static int large_class(size_t psize)
+{
+    int log = 63 - __builtin_clzl(psize);
+    int ind = (log - large_log) * 4 + (int)((psize >> (log - 2)) & 3);
+    return (ind < large_class_num) ? ind : large_class_num - 1;
+}
+
+/*
+ * write_region: writes the prologue and epilogue of a standalone region of size bytes at bp. The block
+ *               between them has no free neighbours, so coalesce can never cross into another region.
+ */
+static void write_region(char *bp, size_t size)
+{
+    *(word_t*)bp = pack(0, true);
+    *(word_t*)(bp + size - wsize) = pack(0, true);
+}
+
+/*
+ * large_lock_all: takes every large class lock in order, so no large block header changes and no large
+ *                 region is carved until large_unlock_all.
+ */
+static void large_lock_all(void)
+{
+    int i;
+
+    for (i = 0; i < large_class_num; i++)
+    {
+        pthread_mutex_lock(&large_lock[i]);
+    }
+}
+
+/*
+ * large_unlock_all: releases the locks taken by large_lock_all.
+ */
+static void large_unlock_all(void)
+{
+    int i;
+
+    for (i = large_class_num - 1; i >= 0; i--)
+    {
+        pthread_mutex_unlock(&large_lock[i]);
+    }
+}
+
+/*
+ * slide_block: moves the movable block block_next down to the start of the free block in front of it and
+ *              updates its handle. The hole it leaves is freed and coalesced with whatever follows, and returned.
+ */
+static block_t *slide_block(block_t *block, block_t *block_next)
+{
+    size_t hole_size = get_size(block);
+    size_t size = get_size(block_next);
+    block_t *hole;
+    void **handle;
+
+    rem_from_free_list(block);
+    memmove(block, block_next, size);
+
+    handle = *(void ***)header_to_payload(block);
+    *handle = (char *)header_to_payload(block) + dsize;
+
+    hole = find_next(block);
+    write_header(hole, hole_size, false);
+    write_footer(hole, hole_size, false);
+    add_to_free_list(hole);
+    return coalesce(hole);
+}
+
+/*
+ * segment_next: returns the prologue of the heap segment before the one whose prologue is at segment,
+ *               or NULL for the first.
+ */
+static word_t *segment_next(word_t *segment)
+{
+    return (word_t *)(*segment & size_mask);
+}
+
+/*
+ * purge_heap: purge pass over the segregated lists. Idle blocks are taken off the lists and marked allocated
+ *             so nothing coalesces into them, discarded with heap_lock released, then freed back as zero blocks.
+ *             A pass looks at no more than purge_scan blocks and the next one resumes at purge_cursor, so
+ *             long lists are covered over several passes instead of in one long lock hold.
+ */
+static size_t purge_heap(void)
+{
+    block_t *batch[64]; //the number inside brackets should match purge_batch
+    size_t sizes[64];
+    block_t *block;
+    size_t purged = 0;
+    int first;
+    int scanned = 0;
+    int lists = 0;
+    int n = 0;
+    int i;
+
+    pthread_mutex_lock(&heap_lock);
+    if (heap_start == NULL)
+    {
+        pthread_mutex_unlock(&heap_lock);
+        return 0;
+    }
+    first = list_index(2*mem_pagesize());
+    if (purge_list < first || purge_list >= seg_num)
+    {
+        purge_list = first;
+        purge_cursor = NULL;
+    }
+    block = (purge_cursor != NULL) ? purge_cursor : all_free_list_start[purge_list];
+    purge_cursor = NULL; // the pass keeps its place itself until it stops
+    while (scanned < purge_scan && n < purge_batch)
+    {
+        if (block == NULL) // end of a list: go on to the next, and stop once back at the list the pass began in
+        {
+            purge_list = (purge_list + 1 < seg_num) ? purge_list + 1 : first;
+            if (++lists >= seg_num - first)
+            {
+                break;
+            }
+            block = all_free_list_start[purge_list];
+            continue;
+        }
+        scanned++;
+
+        block_t *block_next = get_free_next(block);
+        size_t size = get_size(block);
+        if (size >= 2*mem_pagesize() && !get_zero(block))
+        {
+            if (!(block->header & idle_mask))
+            {
+                add_flags(block, idle_mask);
+            }
+            else
+            {
+                rem_from_free_list(block);
+                write_header(block, size, true);
+                write_footer(block, size, true);
+                batch[n++] = block;
+            }
+        }
+        block = block_next;
+    }
+    purge_cursor = block;
+    pthread_mutex_unlock(&heap_lock);
+
+    for (i = 0; i < n; i++)
+    {
+        sizes[i] = purge_block(batch[i]);
+        purged += sizes[i];
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    for (i = 0; i < n; i++)
+    {
+        size_t size = get_size(batch[i]);
+        write_header(batch[i], size, false);
+        write_footer(batch[i], size, false);
+        if (sizes[i] > 0)
+        {
+            add_flags(batch[i], zero_mask);
+        }
+        add_to_free_list(batch[i]);
+        coalesce(batch[i]);
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return purged;
+}
+
+/*
+ * purge_large: purge pass over one large class. Idle blocks are taken off the list while their pages are
+ *              discarded, so no allocation can pick one up meanwhile. Headers are only changed under the
+ *              class lock, so mm_checkheap never reads one being written. Like purge_heap, a pass looks at
+ *              no more than purge_scan blocks, resuming behind large_purge_cursor[ind].
+ */
+static size_t purge_large(int ind)
+{
+    block_t *batch[64]; //the number inside brackets should match purge_batch
+    size_t sizes[64];
+    block_t *block;
+    block_t *block_prev;
+    size_t purged = 0;
+    int scanned = 0;
+    int n = 0;
+    int i;
+
+    pthread_mutex_lock(&large_lock[ind]);
+    block_prev = large_purge_cursor[ind];
+    block = (block_prev == NULL) ? large_free_list[ind] : get_free_next(block_prev);
+    while (block != NULL && scanned < purge_scan && n < purge_batch)
+    {
+        block_t *block_next = get_free_next(block);
+        scanned++;
+        if (get_zero(block))
+        {
+            block_prev = block; // already released, nothing to do
+        }
+        else if (!(block->header & idle_mask))
+        {
+            add_flags(block, idle_mask);
+            block_prev = block;
+        }
+        else
+        {
+            if (block_prev == NULL)
+            {
+                large_free_list[ind] = block_next;
+            }
+            else
+            {
+                set_free_next(block_prev, block_next);
+            }
+            batch[n++] = block;
+        }
+        block = block_next;
+    }
+    large_purge_cursor[ind] = (block == NULL) ? NULL : block_prev; // back to the head once the list is done
+    pthread_mutex_unlock(&large_lock[ind]);
+
+    for (i = 0; i < n; i++)
+    {
+        sizes[i] = purge_block(batch[i]);
+        purged += sizes[i];
+    }
+
+    pthread_mutex_lock(&large_lock[ind]);
+    for (i = 0; i < n; i++)
+    {
+        if (sizes[i] > 0)
+        {
+            add_flags(batch[i], zero_mask);
+            atomic_fetch_sub_explicit(&large_cached, get_size(batch[i]), memory_order_relaxed);
+        }
+        set_free_next(batch[i], large_free_list[ind]);
+        large_free_list[ind] = batch[i];
+    }
+    pthread_mutex_unlock(&large_lock[ind]);
+    return purged;
+}
+
+/*
+ * purge_block: discards the whole pages inside a block nobody else can reach and zeroes the partial pages
+ *              around them, leaving the payload zero past the list links. Returns the bytes discarded,
+ *              or 0 if nothing could be released and the block keeps its contents.
+ */
+static size_t purge_block(block_t *block)
+{
+    size_t page = mem_pagesize();
+    char *start = block->payload + dsize; // keep the list links
+    char *end = (char *)block + get_size(block) - wsize; // footer
+    char *lo = (char *)round_up((size_t)start, page);
+    char *hi = (char *)((size_t)end & ~(page - 1));
+
+    if (lo >= hi || !mem_discard(lo, hi - lo))
+    {
+        return 0;
+    }
+    memset(start, 0, lo - start);
+    memset(hi, 0, end - hi);
+    return hi - lo;
+}
+
+/*
+ * purge_main: body of the background purge thread started by mm_purge_start.
+ */
+static void *purge_main(void *arg)
+{
+    pthread_mutex_lock(&purge_lock);
+    while (purge_running)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += purge_decay_ms / 1000;
+        deadline.tv_nsec += (long)(purge_decay_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&purge_cond, &purge_lock, &deadline);
+        if (!purge_running)
+        {
+            break;
+        }
+
+        pthread_mutex_unlock(&purge_lock);
+        mm_purge();
+        pthread_mutex_lock(&purge_lock);
+    }
+    pthread_mutex_unlock(&purge_lock);
+    return NULL;
+}
+
+#ifdef HARDENED
+/*
+ * check_alloc_block: verifies a block about to be freed: it must be allocated, fit in the heap,
+ *                    and still carry its footer canary.
+ */
+static void check_alloc_block(block_t *block)
+{
+    void *bp = header_to_payload(block);
+    size_t size = get_size(block);
+
+    if (!get_alloc(block))
+    {
+        heap_corrupt("double free or invalid pointer", bp);
+    }
+    if (size < min_block_size || !mem_in_heap(block, size))
+    {
+        heap_corrupt("corrupted block size", bp);
+    }
+    if (*((word_t*)((char*)block + size) - 1) != (block->header ^ get_canary()))
+    {
+        heap_corrupt("footer canary overwritten", bp);
+    }
+}
+#endif
+
+/*
+ * extend_heap: requests additional memory for the heap. The free block is the legal size of a block that can contain length "size".
+ * Then, it creates the free block header/footer, the new epilogue header, and coalesces the free block.
+ * If a large region was carved since the last extension, the new memory is not contiguous with the heap,
+ * so it becomes a new segment with its own prologue; one extra double word is requested to cover that case.
+ * A segment's prologue holds the address of the previous segment's prologue, so heap_segments lists every
+ * segment without a walk through the large regions in between.
+ */
+static block_t *extend_heap(size_t size) 
+{
+    void *bp;
+    block_t *block;
+
+    extend_count++;
+
+    // Allocate an even number of words to maintain alignment
+    size = round_up(size, dsize) + dsize;
+    if ((bp = mem_sbrk(size)) == (void *)-1)
+    {
+        return NULL;
+    }
+
+    if ((char*)bp == (char*)heap_epil + wsize) // contiguous: the old epilogue becomes the new header
+    {
+        block = payload_to_header(bp);
+    }
+    else // new segment: prologue at bp, block header right after it
+    {
+        *(word_t*)bp = (word_t)heap_segments | alloc_mask; // prologues are 16-byte aligned, so the flag bits are free
+        heap_segments = bp;
+        block = (block_t*)((char*)bp + wsize);
+        size -= dsize;
+    }
+	heap_epil = (block_t*)((char*)block + size);
+
+    // Initialize free block header/footer 
+    write_header(block, size, false);
+    write_footer(block, size, false);
+    if (mem_sbrk_fresh(bp)) // never written since the heap was mapped
+    {
+        add_flags(block, zero_mask);
+    }
+	add_to_free_list(block); // Add freed block to global free list
+
+    // Create new epilogue header
+    block_t *block_next = find_next(block);
+    write_header(block_next, 0, true);
+    probe_extend_heap(size, block);
+
+    // Coalesce in case the previous block was free
+    return coalesce(block);
+}
+
+/*
+ * extend_chunk: returns how much to extend the heap by for a request of asize that found no fit. A size class that
+ *               extends again within extend_window mallocs of its last extension doubles its chunk, up to max_chunksize,
+ *               so a burst of allocations extends the heap a few times instead of once per chunksize; each window
+ *               that passes without an extension halves the chunk again, back down to chunksize.
+ */
+static size_t extend_chunk(size_t asize)
+{
+    int ind = list_index(asize);
+    unsigned long windows = (malloc_count - extend_last[ind]) / extend_window;
+
+    extend_last[ind] = malloc_count;
+    if (windows == 0)
+    {
+        extend_size[ind] = (extend_size[ind] < max_chunksize) ? 2*extend_size[ind] : max_chunksize;
+    }
+    else
+    {
+        extend_size[ind] = (windows >= (unsigned long)max_chunk_log) ? chunksize : max(extend_size[ind] >> windows, chunksize);
+    }
+    return extend_size[ind];
+}
+
+/*
+ * coalesce: combines any adjacent free blocks into one large free block.
+ */
+static block_t *coalesce(block_t * block) 
+{
+	// first check that the block itself isn't allocated
+	if (get_alloc(block))
+	{
+		return block;
+	}
+
+	block_t* coa_block = NULL; //the coalesced block to return
+	word_t* block_prev_footer = find_prev_footer(block);
+	word_t* block_next_header = (word_t*)((char*)block + get_size(block));
 
 	bool alloc_prev = extract_alloc(*block_prev_footer);
 	bool alloc_next = extract_alloc(*block_next_header);
+	bool zero = get_zero(block); //merged block stays zero only if every part was
 
 	//if both prev and next blocks are free, get block positions
 	if (!alloc_prev && !alloc_next) //if previous and next blocks are unallocated and within the heap
@@ -383,8 +2270,14 @@ static block_t *coalesce(block_t * block)
 		rem_from_free_list(block_next);
 		rem_from_free_list(block);
 
+		zero = zero && get_zero(block_prev) && get_zero(block_next);
 		write_header(block_prev, size_total, false);
 		write_footer(block_next, size_total, false);
+		if (zero)
+		{
+			zero_seam(block);
+			zero_seam(block_next);
+		}
 		coa_block = block_prev;
 	}
 
@@ -397,8 +2290,13 @@ static block_t *coalesce(block_t * block)
 		rem_from_free_list(block_next);
 		rem_from_free_list(block);
 
+		zero = zero && get_zero(block_next);
 		write_header(block, size_total, false);
 		write_footer(block_next, size_total, false);
+		if (zero)
+		{
+			zero_seam(block_next);
+		}
 		coa_block = block;
 	}
 
@@ -411,8 +2309,13 @@ static block_t *coalesce(block_t * block)
 		rem_from_free_list(block_prev);
 		rem_from_free_list(block);
 
+		zero = zero && get_zero(block_prev);
 		write_header(block_prev, size_total, false);
 		write_footer(block, size_total, false);
+		if (zero)
+		{
+			zero_seam(block);
+		}
 		coa_block = block_prev;
 	}
 
@@ -423,151 +2326,411 @@ static block_t *coalesce(block_t * block)
 		rem_from_free_list(block);
 	}
 
-	add_to_free_list(coa_block); //add coalesced block back to the global free list
-	return coa_block;
+	if (zero)
+	{
+		add_flags(coa_block, zero_mask);
+	}
+	add_to_free_list(coa_block); //add coalesced block back to the global free list
+	if (!alloc_prev || !alloc_next)
+	{
+		merge_count++;
+		probe_coalesce(coa_block, get_size(coa_block));
+	}
+	return coa_block;
+}
+
+/*
+ * place:  modifies the free block to be read as allocated by writing the block header to "true"
+ */
+static void place(block_t *block, size_t asize)
+{
+    size_t csize = get_size(block);
+    bool zero = get_zero(block);
+
+    if ((csize - asize) >= min_block_size) // "block" = block to place the data into, asize = adjusted size of requested memory
+    {
+        block_t *block_next;
+		rem_from_free_list(block);
+        write_header(block, asize, true);
+        write_footer(block, asize, true);
+        
+        //if another block can fit in the remaining space, perform splitting
+        block_next = find_next(block); //next block is the block after the size of current block has been traversed in the heap
+        write_header(block_next, csize-asize, false);
+        write_footer(block_next, csize-asize, false);
+        if (zero) // the remainder was untouched payload of a zero block
+        {
+            add_flags(block_next, zero_mask);
+        }
+		add_to_free_list(block_next);
+    }
+
+    else
+    { 
+		rem_from_free_list(block);
+        write_header(block, csize, true);
+        write_footer(block, csize, true);
+    }
+}
+
+/*
+ * find_fit: searches the free list of asize's category, then the larger ones, for a suitable empty block that can fit the new data with size "asize".
+ *           Each list is first searched through its fit window, which holds sizes and pointers contiguously, so candidates cost
+ *           no cache miss until one is picked. Only a list with blocks outside its window is walked, prefetching the next
+ *           candidate while the current one is compared. Either search stops early at a block too close in size to split.
+ *           With BOUNDED_LATENCY, it instead takes the first block of the first non-empty list at or above asize from list_map.
+ */
+static block_t *find_fit(size_t asize)
+{
+#ifdef BOUNDED_LATENCY
+    // Every block of a list is at least its base, so start at the first list whose base is asize or above
+    int ind = list_index(asize);
+    int log = 63 - __builtin_clzl(asize);
+    if (ind < bounded_lists && asize % ((size_t)1 << (log - 2)) != 0)
+    {
+        ind++;
+    }
+
+    word_t map = list_map & (~(word_t)0 << ind);
+    if (map == 0)
+    {
+        return NULL;
+    }
+    block_t* free_block = all_free_list_start[__builtin_ctzl(map)];
+
+    // Only the open-ended last list can hold blocks smaller than asize; walking it is outside the bound
+    while (free_block != NULL && get_size(free_block) < asize)
+    {
+        free_block = get_free_next(free_block);
+    }
+    return free_block;
+#else
+    int ind;
+    for (ind = list_index(asize); ind < seg_num; ind++)
+    {
+        size_t min_diff = (size_t)-1;
+        block_t* min_block = NULL; //if no fit is found, min_block will remain NULL
+        int i;
+
+        for (i = 0; i < fit_count[ind]; i++)
+        {
+            fit_entry_t* entry = &fit_entries[ind][i];
+            if (asize <= entry->size && entry->size - asize < min_diff)
+            {
+                min_diff = entry->size - asize;
+                min_block = entry->block;
+                if (min_diff < min_block_size) //place could not split anything off a closer fit either
+                {
+                    break;
+                }
+            }
+        }
+        if (min_block != NULL)
+        {
+            return min_block;
+        }
+        if (!fit_partial[ind])
+        {
+            continue;
+        }
+
+        block_t* free_block = all_free_list_start[ind];
+        i = 0;
+        while (free_block != NULL && i <= N) //perform Nth fitting with global variable
+        {
+            block_t* block_next = get_free_next(free_block);
+            __builtin_prefetch(block_next);
+
+            size_t size = get_size(free_block);
+            if (asize <= size && size - asize < min_diff)
+            {
+                min_diff = size - asize;
+                min_block = free_block;
+                if (min_diff < min_block_size) //place could not split anything off a closer fit either
+                {
+                    break;
+                }
+            }
+
+            free_block = block_next;
+            i++;
+        }
+
+        if (min_block != NULL)
+        {
+            return min_block;
+        }
+    }
+
+    return NULL;
+#endif
+}
+
+/* 
+ * mm_checkheap: iterates through the entire heap and checks that
+ * 1. all blocks are aligned, within their region, and at least min_block_size bytes
+ * 2. all headers and footers match for free blocks, and allocated footers carry the canary
+ * 3. there are no two contiguous free blocks
+ * 4. every free list is doubly linked, ends at its end pointer, and holds only free blocks of its size class
+ * 5. the free lists hold exactly the free blocks found in the heap, and fit windows only free blocks of their class
+ * 6. the large lists hold only free large blocks of their class
+ * 7. the segment list leads from the newest heap segment to the first
+ * Called with heap_lock held. The large locks are taken for the whole check, so no large block changes
+ * under it. Prints the failed check with the caller's line when DEBUG is defined.
+ */
+bool mm_checkheap(int line)  
+{ 
+    bool ok;
+
+    large_lock_all();
+    ok = check_heap(line);
+    large_unlock_all();
+    return ok;
+}
+
+/*
+ * check_heap: body of mm_checkheap, called with every lock held.
+ */
+static bool check_heap(int line)
+{
+    block_t* cur_block;
+    size_t free_blocks = 0; //free blocks met walking the heap, which the free lists must hold exactly
+    size_t prologues = 0; //prologues met walking the heap, which bounds the segment list
+    word_t* segment;
+    int r;
+    int i;
+
+    //walk each memlib region from the block after its first prologue to its last epilogue
+    for (r = 0; r < mem_region_count(); r++)
+    {
+        block_t* heap_last = (block_t*)((char*)mem_region_hi(r) + 1 - wsize); //epilogue of the region
+        if ((void*)heap_last < mem_region_lo(r))
+        {
+            continue; //nothing carved from this region yet
+        }
+        prologues++;
+
+        for (cur_block = (block_t*)((char*)mem_region_lo(r) + wsize); cur_block != heap_last; cur_block = find_next(cur_block))
+        {
+            //an epilogue followed by a prologue starts the next segment or large region
+            if (get_size(cur_block) == 0)
+            {
+                if (!get_alloc(cur_block) || !extract_alloc(*(word_t*)((char*)cur_block + wsize)))
+                {
+                    dbg_printf("line %d: bad prologue or epilogue at %p\n", line, (void*)cur_block);
+                    return false;
+                }
+                cur_block = (block_t*)((char*)cur_block + dsize);
+                prologues++;
+                if (cur_block == heap_last)
+                {
+                    break;
+                }
+            }
+
+            //check if all blocks are aligned, big enough, and within the region
+			if ((void*)cur_block < mem_region_lo(r) || cur_block > heap_last ||
+			    (size_t)header_to_payload(cur_block) % dsize != 0 ||
+			    get_size(cur_block) < min_block_size || (char*)find_next(cur_block) > (char*)heap_last)
+			{
+				dbg_printf("line %d: block %p out of place\n", line, (void*)cur_block);
+				return false;
+			}
+
+			//check that there are no two contiguous free blocks
+			bool cur_alloc = get_alloc(cur_block);
+			bool next_alloc = get_alloc(find_next(cur_block));
+			if (!cur_alloc && !next_alloc) //if current and next blocks are both free
+			{
+				dbg_printf("line %d: free blocks %p and %p not coalesced\n", line, (void*)cur_block, (void*)find_next(cur_block));
+				return false;
+			}
+
+			//check that allocated footers still carry the canary, and free footers match their header
+			word_t cur_footer = *(((word_t*)find_next(cur_block)) - 1);
+			bool cur_large = (cur_block->header & large_mask) != 0;
+			if (cur_alloc ? cur_footer != (cur_block->header ^ get_canary()) : cur_footer != cur_block->header)
+			{
+				dbg_printf("line %d: footer of %p does not match its header\n", line, (void*)cur_block);
+				return false;
+			}
+
+			if (!cur_alloc && !cur_large)
+			{
+				free_blocks++;
+			}
+        }
+    }
+
+    //check that the segment list passes through heap prologues only and ends at the first one
+    for (segment = heap_segments; segment != NULL && segment != (word_t*)heap_prol; segment = segment_next(segment))
+    {
+        if (prologues == 0 || !mem_in_heap(segment, dsize) || !extract_alloc(*segment))
+        {
+            dbg_printf("line %d: bad segment %p\n", line, (void*)segment);
+            return false;
+        }
+        prologues--; //a list longer than the prologues in the heap runs out here, which also stops a cycle
+    }
+    if (segment != (word_t*)heap_prol)
+    {
+        dbg_printf("line %d: segment list does not end at the heap prologue\n", line);
+        return false;
+    }
+
+    //check that every free list is well linked and holds only free blocks of its class
+    for (i = 0; i < seg_num; i++)
+    {
+        block_t* free_block = all_free_list_start[i];
+        block_t* free_prev = NULL;
+        while (free_block != NULL)
+        {
+            if (free_blocks == 0 || !mem_in_heap(free_block, min_block_size) || get_alloc(free_block) ||
+                list_index(get_size(free_block)) != i || get_free_prev(free_block) != free_prev)
+            {
+                dbg_printf("line %d: bad block %p on free list %d\n", line, (void*)free_block, i);
+                return false;
+            }
+            free_blocks--; //a list longer than the free blocks in the heap runs out here, which also stops a cycle
+            free_prev = free_block;
+            free_block = get_free_next(free_block);
+        }
+        if (all_free_list_end[i] != free_prev)
+        {
+            dbg_printf("line %d: free list %d does not end at its end pointer\n", line, i);
+            return false;
+        }
+#ifdef BOUNDED_LATENCY
+        if (((list_map >> i) & 1) != (all_free_list_start[i] != NULL))
+        {
+            dbg_printf("line %d: list map bit %d is stale\n", line, i);
+            return false;
+        }
+#else
+        //check that the fit window only holds blocks of this list, with their sizes
+        int j;
+        for (j = 0; j < fit_count[i]; j++)
+        {
+            block_t* entry_block = fit_entries[i][j].block;
+            if (get_alloc(entry_block) || get_size(entry_block) != fit_entries[i][j].size || list_index(fit_entries[i][j].size) != i)
+            {
+                dbg_printf("line %d: stale fit window entry %p on list %d\n", line, (void*)entry_block, i);
+                return false;
+            }
+        }
+#endif
+    }
+    if (free_blocks != 0)
+    {
+        dbg_printf("line %d: %zu free blocks are on no free list\n", line, free_blocks);
+        return false;
+    }
+
+    //check that all blocks in the large lists are free large blocks
+    for (i = 0; i < large_class_num; i++)
+    {
+        block_t* free_block;
+        for (free_block = large_free_list[i]; free_block != NULL; free_block = get_free_next(free_block))
+        {
+            if (get_alloc(free_block) || !(free_block->header & large_mask) || large_class(get_size(free_block) - dsize) != i)
+            {
+                dbg_printf("line %d: bad block %p on large list %d\n", line, (void*)free_block, i);
+                return false;
+            }
+        }
+    }
+    return true;
 }
 
 /*
- * place:  modifies the free block to be read as allocated by writing the block header to "true"
+ * clear_stats: resets the counters reported by mm_stats, for a new or reattached heap.
  */
-static void place(block_t *block, size_t asize)
+static void clear_stats(void)
 {
-    size_t csize = get_size(block);
+    int i;
 
-    if ((csize - asize) >= min_block_size) // "block" = block to place the data into, asize = adjusted size of requested memory
+    malloc_count = 0;
+    extend_count = 0;
+    free_count = 0;
+    fit_miss_count = 0;
+    merge_count = 0;
+    atomic_store_explicit(&grow_count, 0, memory_order_relaxed);
+    atomic_store_explicit(&copy_count, 0, memory_order_relaxed);
+    for (i = 0; i < large_class_num; i++)
     {
-        block_t *block_next;
-		rem_from_free_list(block);
-        write_header(block, asize, true);
-        write_footer(block, asize, true);
-        
-        //if another block can fit in the remaining space, perform splitting
-        block_next = find_next(block); //next block is the block after the size of current block has been traversed in the heap
-        write_header(block_next, csize-asize, false);
-        write_footer(block_next, csize-asize, false);
-		add_to_free_list(block_next);
-    }
-
-    else
-    { 
-		rem_from_free_list(block);
-        write_header(block, csize, true);
-        write_footer(block, csize, true);
+        large_malloc_count[i] = 0;
+        large_free_count[i] = 0;
     }
 }
 
 /*
- * find_fit: searches through the entire free lists to find a suitable empty block that can fit the new data with size "asize".
+ * probe_malloc_entry: USDT probe mm:malloc_entry(size), on every malloc and calloc.
  */
-static block_t *find_fit(size_t asize)
+static void probe_malloc_entry(size_t size)
 {
-    block_t* free_list_start = NULL;
-    if (asize >= cat1 && asize < cat2)
-    {
-        free_list_start = all_free_list_start[first_list];
-        if (free_list_start == NULL)
-        {
-            free_list_start = all_free_list_start[second_list];
-            if(free_list_start == NULL)
-            {
-                free_list_start = all_free_list_start[third_list];     
-			}
-		}
-	}
-
-    if (asize  >= cat2 && asize < cat3) //if block is between 48 and 96 bytes
-    {
-        free_list_start = all_free_list_start[second_list];
-         if (free_list_start == NULL)
-        {
-            free_list_start = all_free_list_start[third_list];
-        }
-	}
-
-    if (asize  >= cat3) //if block is larger than 96 bytes
-    {
-        free_list_start = all_free_list_start[third_list];
-	}
+#ifdef USDT_PROBES
+    DTRACE_PROBE1(mm, malloc_entry, size);
+#endif
+}
 
-	if (free_list_start == NULL) //if there are no free blocks
-	{
-		return NULL;
-	}
+/*
+ * probe_malloc_exit: USDT probe mm:malloc_exit(size, bp), with bp NULL if the allocation failed.
+ */
+static void probe_malloc_exit(size_t size, void *bp)
+{
+#ifdef USDT_PROBES
+    DTRACE_PROBE2(mm, malloc_exit, size, bp);
+#endif
+}
 
-	block_t* free_block = free_list_start;
-	int i = 0;
-	size_t min_diff = mem_heapsize();
-	block_t* min_block = NULL; //if no fit is found, min_block will remain NULL
-	while (free_block != NULL && i <= N) //perform Nth fitting with global variable
-	{
-		if (asize <= get_size(free_block))
-		{
-			if (get_size(free_block) - asize < min_diff)
-			{
-				min_diff = get_size(free_block) - asize;
-				min_block = free_block;
-			}
-		}
+/*
+ * probe_free: USDT probe mm:free(bp), on every free of a non-NULL pointer.
+ */
+static void probe_free(void *bp)
+{
+#ifdef USDT_PROBES
+    DTRACE_PROBE1(mm, free, bp);
+#endif
+}
 
-		free_block = free_block->free_next;
-		i++;
-	}
+/*
+ * probe_fit_miss: USDT probe mm:fit_miss(asize), when no free block fits a block of asize bytes.
+ */
+static void probe_fit_miss(size_t asize)
+{
+#ifdef USDT_PROBES
+    DTRACE_PROBE1(mm, fit_miss, asize);
+#endif
+}
 
-    return min_block; 
+/*
+ * probe_extend_heap: USDT probe mm:extend_heap(size, block), with the new free block of size bytes.
+ */
+static void probe_extend_heap(size_t size, block_t *block)
+{
+#ifdef USDT_PROBES
+    DTRACE_PROBE2(mm, extend_heap, size, block);
+#endif
 }
 
-/* 
- * mm_checkheap: iterates through the entire heap and checks that
- * 1. all headers and footers match for free blocks
- * 2. all blocks are within heap range
- * 3. there are no two contiguous free blocks
- * 4. all blocks in the free list are unallocated
+/*
+ * probe_coalesce: USDT probe mm:coalesce(block, size), when a free block merged with a neighbour into block.
  */
-bool mm_checkheap(int line)  
-{ 
-    block_t* cur_block = heap_start;
-  
-	for (cur_block = heap_start; get_size(cur_block) > 0; cur_block = find_next(cur_block))
-    {
-        //check if all blocks are within heap range
-		if (cur_block < heap_prol || cur_block > heap_epil)
-		{
-			return false;
-		}
+static void probe_coalesce(block_t *block, size_t size)
+{
+#ifdef USDT_PROBES
+    DTRACE_PROBE2(mm, coalesce, block, size);
+#endif
+}
 
-		//check that there are no two contiguous free blocks
-		bool cur_alloc = get_alloc(cur_block);
-		bool next_alloc = get_alloc(find_next(cur_block));
-		if (!cur_alloc && !next_alloc) //if current and next blocks are both free
-		{
-			return false;
-		}
-      
-		//check that all blocks in the free list are unallocated
-        int i;
-        for (i = 0; i < seg_num; i++)
-        {
-            block_t* free_block = all_free_list_start[i];
-		    while (free_block != NULL)
-		    {
-		    	if (get_alloc(free_block))
-		    	{
-		    		return false;
-		    	}
-		    	
-                //check if headers and footers match for all free blocks
-		        word_t cur_header = free_block->header;
-		        word_t cur_footer = *(((word_t*)((char*)free_block + get_size(free_block))) - 1);
-		        if (cur_header != cur_footer)
-		        {
-		        	return false;
-		        }
-
-		    	free_block = free_block->free_next;
-		    }
-		}
-    }
-    return true;
+/*
+ * probe_realloc_copy: USDT probe mm:realloc_copy(ptr, newptr, size), when realloc moves size bytes.
+ */
+static void probe_realloc_copy(void *ptr, void *newptr, size_t size)
+{
+#ifdef USDT_PROBES
+    DTRACE_PROBE3(mm, realloc_copy, ptr, newptr, size);
+#endif
 }
 
 /*
@@ -660,7 +2823,57 @@ static void write_header(block_t *block, size_t size, bool alloc)
 static void write_footer(block_t *block, size_t size, bool alloc)
 {
     word_t *footerp = (word_t *)((block->payload) + get_size(block) - dsize);
-    *footerp = pack(size, alloc);
+    *footerp = alloc ? (pack(size, alloc) ^ get_canary()) : pack(size, alloc);
+}
+
+/*
+ * get_zero: returns true when a free block's payload is known to be zero apart from
+ *           its first dsize bytes, which hold the free list links.
+ */
+static bool get_zero(block_t *block)
+{
+    return (block->header & zero_mask) != 0;
+}
+
+/*
+ * add_flags: sets flag bits such as zero_mask in both the header and footer of a free block,
+ *            so the two still match. Any later write_header clears them again.
+ */
+static void add_flags(block_t *block, word_t flags)
+{
+    word_t *footerp = (word_t *)((block->payload) + get_size(block) - dsize);
+    block->header |= flags;
+    *footerp |= flags;
+}
+
+/*
+ * zero_seam: clears the boundary tags and links left inside a merged block where a zero block
+ *            was absorbed: the footer before it, its header and its two free list links.
+ */
+static void zero_seam(block_t *block)
+{
+    memset(find_prev_footer(block), 0, 2*dsize);
+}
+
+/*
+ * clear_payload: zeroes len bytes at bp. Large ranges are cleared by discarding their whole
+ *                pages instead of writing them, so pages the caller never touches stay unmapped.
+ */
+static void clear_payload(void *bp, size_t len)
+{
+    if (len >= discard_size)
+    {
+        size_t page = mem_pagesize();
+        char *lo = (char *)round_up((size_t)bp, page);
+        char *hi = (char *)(((size_t)bp + len) & ~(page - 1));
+        if (lo < hi && mem_discard(lo, hi - lo))
+        {
+            memset(bp, 0, lo - (char *)bp);
+            memset(hi, 0, (char *)bp + len - hi);
+            return;
+        }
+    }
+    memset(bp, 0, len);
 }
 
 
@@ -718,6 +2931,114 @@ static void *header_to_payload(block_t *block)
     return (void *)(block->payload);
 }
 
+#ifdef HARDENED
+/*
+ * link_key: returns the value XORed into a free list link stored at slot. Mixing in the slot's
+ *           address makes every link's key different; NULL links are stored as plain zero, so
+ *           list ends and the link words of allocated blocks never hold a key.
+ */
+static word_t link_key(void *slot)
+{
+    return ((word_t)slot >> 12) ^ heap_secret;
+}
+#endif
+
+/*
+ * get_free_prev: returns the previous block in the free list, decoding the
+ *                stored link when the heap is hardened.
+ */
+static block_t *get_free_prev(block_t *block)
+{
+#ifdef HARDENED
+    word_t link = (word_t)block->free_prev;
+    return (block_t *)((link == 0) ? 0 : link ^ link_key(&block->free_prev));
+#else
+    return block->free_prev;
+#endif
+}
+
+/*
+ * get_free_next: returns the next block in the free list, decoding the
+ *                stored link when the heap is hardened.
+ */
+static block_t *get_free_next(block_t *block)
+{
+#ifdef HARDENED
+    word_t link = (word_t)block->free_next;
+    return (block_t *)((link == 0) ? 0 : link ^ link_key(&block->free_next));
+#else
+    return block->free_next;
+#endif
+}
+
+/*
+ * set_free_prev: stores the previous free list link of a block, encoding it
+ *                when the heap is hardened.
+ */
+static void set_free_prev(block_t *block, block_t *prev)
+{
+#ifdef HARDENED
+    block->free_prev = (block_t *)((prev == NULL) ? 0 : (word_t)prev ^ link_key(&block->free_prev));
+#else
+    block->free_prev = prev;
+#endif
+}
+
+/*
+ * set_free_next: stores the next free list link of a block, encoding it
+ *                when the heap is hardened.
+ */
+static void set_free_next(block_t *block, block_t *next)
+{
+#ifdef HARDENED
+    block->free_next = (block_t *)((next == NULL) ? 0 : (word_t)next ^ link_key(&block->free_next));
+#else
+    block->free_next = next;
+#endif
+}
+
+/*
+ * get_canary: returns the value XORed into the footer of allocated blocks.
+ *             The low 4 bits are clear so the footer's alloc bit still reads
+ *             correctly in coalesce. Zero unless the heap is hardened.
+ */
+static word_t get_canary(void)
+{
+#ifdef HARDENED
+    return canary_secret & size_mask;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * new_heap_secret: draws a fresh secret for a new heap, falling back to
+ *                  address and stack entropy if the kernel has none to give.
+ */
+static word_t new_heap_secret(void)
+{
+    static word_t drawn = 0; //secrets drawn so far, so two fallbacks in a row still differ
+    word_t secret = 0;
+    drawn++;
+    if (getrandom(&secret, sizeof(secret), GRND_NONBLOCK) != sizeof(secret))
+    {
+        secret = (word_t)&secret ^ ((word_t)mem_heap_lo() << 17) ^ (drawn * 0x9e3779b97f4a7c15);
+    }
+    return secret;
+}
+
+#if defined(HARDENED) || defined(GUARD_PAGES)
+/*
+ * heap_corrupt: reports damaged heap metadata and aborts, since carrying on
+ *               would hand out memory through a corrupted free list.
+ */
+static void heap_corrupt(const char *msg, void *addr)
+{
+    fprintf(stderr, "ERROR: heap corruption detected: %s at %p\n", msg, addr);
+    abort();
+}
+#endif
+
 /*
  * list_add: given a block to be free, pointers to a free list, and the index of the array of free list pointers, 
  *                adds the block to the free list and updates the global array variable
@@ -734,15 +3055,21 @@ static void list_add(block_t* block, block_t* free_list_start, block_t* free_lis
 	{
 		free_list_start = block;
 		free_list_end = block;
-		block->free_prev = NULL;
-		block->free_next = NULL;
+		set_free_prev(block, NULL);
+		set_free_next(block, NULL);
 	}
 
 	else
 	{
-		block->free_next = free_list_start;
-		block->free_prev = NULL;
-		free_list_start->free_prev = block;
+#ifdef HARDENED
+		if (get_free_prev(free_list_start) != NULL)
+		{
+			heap_corrupt("corrupted free list head", free_list_start);
+		}
+#endif
+		set_free_next(block, free_list_start);
+		set_free_prev(block, NULL);
+		set_free_prev(free_list_start, block);
 		free_list_start = block;
 	}
 
@@ -762,6 +3089,15 @@ static void list_rem(block_t* block, block_t* free_list_start, block_t* free_lis
 		return;
 	}
 
+	if (block == purge_cursor) //keep purge_heap's place, moving on to the next list after the last block
+	{
+		purge_cursor = get_free_next(block);
+		if (purge_cursor == NULL)
+		{
+			purge_list++;
+		}
+	}
+
 	if (free_list_start == free_list_end) //if there is only one free block
 	{
 		free_list_start = NULL;
@@ -770,52 +3106,82 @@ static void list_rem(block_t* block, block_t* free_list_start, block_t* free_lis
 
 	else
 	{
+		block_t* block_prev = get_free_prev(block);
+		block_t* block_next = get_free_next(block);
+
+#ifdef HARDENED
+		//safe unlinking: both neighbours must point back at the block
+		if ((block_prev != NULL && get_free_next(block_prev) != block) ||
+		    (block_next != NULL && get_free_prev(block_next) != block))
+		{
+			heap_corrupt("corrupted free list links", block);
+		}
+#endif
+
 		if (block == free_list_start) //if removed block is the start of the free list
 		{
-			free_list_start = block->free_next;
-			free_list_start->free_prev = NULL;
+			free_list_start = block_next;
+			set_free_prev(free_list_start, NULL);
 		}
 
 		else if (block == free_list_end) //if removed block is the end of the free list
 		{
-			free_list_end = block->free_prev;
-			free_list_end->free_next = NULL;
+			free_list_end = block_prev;
+			set_free_next(free_list_end, NULL);
 		}
 
 		else
 		{
-			block->free_next->free_prev = block->free_prev;
-			block->free_prev->free_next = block->free_next;
+			set_free_prev(block_next, block_prev);
+			set_free_next(block_prev, block_next);
 		}
 	}
 
-	block->free_prev = NULL;
-	block->free_next = NULL;
+	set_free_prev(block, NULL);
+	set_free_next(block, NULL);
 
     all_free_list_start[ind] = free_list_start;
     all_free_list_end[ind] = free_list_end;
 }
 
 /*
- * add_to_free_list: calls list_add according to the size of the block to be added to a free list
+ * list_index: returns the index of the segregated free list for blocks of the given size
  */
-static void add_to_free_list(block_t* block) //adds a newly freed block to the global segmented free lists
+static int list_index(size_t size)
 {
-    size_t block_size = get_size(block);
-    if (block_size >= cat1 && block_size < cat2) //if block is the smallest size 
+#ifdef BOUNDED_LATENCY
+    int log = 63 - __builtin_clzl(size);
+    if ((log - min_block_log) * 4 >= bounded_lists)
     {
-        list_add(block, all_free_list_start[first_list], all_free_list_end[first_list], first_list);
-	}
-
-    if (block_size  >= cat2 && block_size < cat3) //if block is between 48 and 96 bytes
+        return bounded_lists;
+    }
+    return (log - min_block_log) * 4 + (int)((size >> (log - 2)) & 3); //four lists per power of two
+#else
+    if (size < cat2) //if block is the smallest size
     {
-        list_add(block, all_free_list_start[second_list], all_free_list_end[second_list], second_list);
-	}
-
-    if (block_size  >= cat3) //if block is larger than 96 bytes
+        return first_list;
+    }
+    if (size < cat3) //if block is between 48 and 64 bytes
     {
-        list_add(block, all_free_list_start[third_list], all_free_list_end[third_list], third_list);
-	}
+        return second_list;
+    }
+    int ind = third_list + (63 - __builtin_clzl(size)) - cat3_log; //one list per power of two from 64 bytes
+    return (ind < seg_num) ? ind : seg_num - 1;
+#endif
+}
+
+/*
+ * add_to_free_list: calls list_add according to the size of the block to be added to a free list
+ */
+static void add_to_free_list(block_t* block) //adds a newly freed block to the global segmented free lists
+{
+    int ind = list_index(get_size(block));
+    list_add(block, all_free_list_start[ind], all_free_list_end[ind], ind);
+#ifdef BOUNDED_LATENCY
+    list_map |= (word_t)1 << ind;
+#else
+    window_add(ind, block);
+#endif
 }
 
 /*
@@ -823,41 +3189,82 @@ static void add_to_free_list(block_t* block) //adds a newly freed block to the g
  */
 static void rem_from_free_list(block_t* block) //removes allocated block from global free list
 {
-    size_t block_size = get_size(block);
-
-    if (block_size >= cat1 && block_size < cat2) //if block is the smallest size 
+    int ind = list_index(get_size(block));
+    list_rem(block, all_free_list_start[ind], all_free_list_end[ind], ind);
+#ifdef BOUNDED_LATENCY
+    if (all_free_list_start[ind] == NULL)
     {
-        list_rem(block,all_free_list_start[first_list], all_free_list_end[first_list], first_list);
-	}
+        list_map &= ~((word_t)1 << ind);
+    }
+#else
+    window_rem(ind, block);
+#endif
+}
 
-    if (block_size  >= cat2 && block_size < cat3) //if block is between 48 and 96 bytes
+#ifndef BOUNDED_LATENCY
+/*
+ * window_add: mirrors a block just added to free list ind in the list's fit window, overwriting the
+ *             entries in turn once the window is full. Overwritten blocks stay on the list.
+ */
+static void window_add(int ind, block_t* block)
+{
+    int slot = fit_count[ind];
+    if (slot == fit_window)
     {
-        list_rem(block, all_free_list_start[second_list], all_free_list_end[second_list], second_list);
-	}
-
-    if (block_size  >= cat3) //if block is larger than 96 bytes
+        slot = fit_evict[ind];
+        fit_evict[ind] = (slot + 1) % fit_window;
+        fit_partial[ind] = true;
+    }
+    else
     {
-        list_rem(block, all_free_list_start[third_list], all_free_list_end[third_list], third_list);
-	}
+        fit_count[ind]++;
+    }
+    fit_entries[ind][slot].size = get_size(block);
+    fit_entries[ind][slot].block = block;
 }
 
 /*
- * clear_free_list: on calling mm_init, clears all the segregated free lists so that they are empty
+ * window_rem: drops a block just removed from free list ind from the list's fit window, if it is there.
  */
-static void clear_free_list()
+static void window_rem(int ind, block_t* block)
 {
-    if (all_free_list_start[first_list] == NULL && all_free_list_start[second_list] == NULL && all_free_list_start[third_list] == NULL)
+    int i;
+    for (i = 0; i < fit_count[ind]; i++)
     {
-        return;
-	}
+        if (fit_entries[ind][i].block == block)
+        {
+            fit_entries[ind][i] = fit_entries[ind][--fit_count[ind]];
+            break;
+        }
+    }
+    if (all_free_list_start[ind] == NULL) //an empty list is fully mirrored again
+    {
+        fit_count[ind] = 0;
+        fit_evict[ind] = 0;
+        fit_partial[ind] = false;
+    }
+}
+#endif
 
+/*
+ * clear_free_list: on calling mm_init, clears all the segregated free lists so that they are empty.
+ *                  The old heap may already have been reset, so its links are not followed.
+ */
+static void clear_free_list()
+{
     int i;
     for (i = 0; i < seg_num; i++)
     {
-        block_t* free_block;
-	    for (free_block = all_free_list_start[i]; free_block != NULL; free_block = free_block->free_next)
-	    {
-	    	rem_from_free_list(free_block);
-	    }
+        all_free_list_start[i] = NULL;
+        all_free_list_end[i] = NULL;
+#ifndef BOUNDED_LATENCY
+        fit_count[i] = 0;
+        fit_evict[i] = 0;
+        fit_partial[i] = false;
+#endif
 	}
+#ifdef BOUNDED_LATENCY
+    list_map = 0;
+#endif
+    purge_cursor = NULL;
 }
@@ -9,6 +9,14 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
+extern size_t mm_malloc_usable_size(void *ptr);
+extern void *mm_malloc_with_size(size_t size, size_t *usable);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_valloc(size_t size);
+extern void *mm_pvalloc(size_t size);
+extern void *mm_reallocarray(void *ptr, size_t nmemb, size_t size);
 
 #else
 
@@ -17,10 +25,58 @@ extern void *malloc (size_t size);
 extern void free (void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc (size_t nmemb, size_t size);
+extern size_t malloc_usable_size(void *ptr);
+extern void *malloc_with_size(size_t size, size_t *usable);
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *aligned_alloc(size_t alignment, size_t size);
+extern void *memalign(size_t alignment, size_t size);
+extern void *valloc(size_t size);
+extern void *pvalloc(size_t size);
+extern void *reallocarray(void *ptr, size_t nmemb, size_t size);
 
 #endif
 
 extern bool mm_init(void);
 
+/* Relocatable allocations reached through a handle, and heap compaction. On a file-backed heap the handle must live in the heap */
+extern void *mm_malloc_movable(size_t size, void **handle);
+extern void mm_free_movable(void **handle);
+extern size_t mm_compact(void);
+
+/* Reattach to a file-backed heap from mem_init_file, and find data in it again */
+extern bool mm_attach(void);
+extern void mm_detach(void);
+extern void mm_set_root(void *ptr);
+extern void *mm_get_root(void);
+
+/* Grow the heap and fault it in ahead of time, so mallocs need not extend it */
+extern bool mm_reserve(size_t size);
+
+/* Guard one malloc in every so many with an inaccessible page, when built with GUARD_PAGES and the heap is not in a file */
+extern void mm_guard_sample(unsigned int every);
+
+/* Number of heap extensions since mm_init */
+extern size_t mm_extend_count(void);
+
+/* Event counts since mm_init; the same events are traceable through the mm USDT probes */
+typedef struct
+{
+    size_t mallocs;       /* allocations from the segregated lists */
+    size_t frees;         /* blocks returned to the segregated lists */
+    size_t fit_misses;    /* allocations no free block fitted */
+    size_t extends;       /* heap extensions */
+    size_t merges;        /* frees merged with a free neighbour */
+    size_t grows;         /* reallocs that grew a block in place */
+    size_t copies;        /* reallocs that moved a block */
+    size_t large_mallocs; /* allocations of large blocks */
+    size_t large_frees;   /* frees of large blocks */
+} mm_stats_t;
+extern void mm_stats(mm_stats_t *stats);
+
+/* Return idle free pages to the system, once or from a background thread */
+extern size_t mm_purge(void);
+extern bool mm_purge_start(unsigned int decay_ms);
+extern void mm_purge_stop(void);
+
 /* This is for debugging.  Returns false if error encountered */
 extern bool mm_checkheap(int lineno);
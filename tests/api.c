@@ -0,0 +1,245 @@
+/*
+ * api.c: checks the allocation calls beside malloc, built with DRIVER (see the Makefile's test target).
+ *
+ * posix_memalign, aligned_alloc, memalign, valloc and pvalloc are asked for every power of two alignment up to
+ * max_alignment, at small sizes and at sizes that take the large block path, where the payload sits behind a
+ * tag word inside a large block. Each block must be aligned, hold at least its size, keep its contents through
+ * realloc, and free cleanly. Bad alignments and sizes that overflow must fail with the right error.
+ * mm_malloc_usable_size and mm_malloc_with_size must report room the caller can fill, and the same room for
+ * the same block. Allocations within an mm_reserve must not extend the heap.
+ *
+ * Usage: api. Exits with status 1 at the first failure.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+static const size_t max_alignment = (size_t)1 << 16; //largest alignment asked for
+static const size_t sizes[] = {1, 24, 100, 4000, 40000, 70000, (size_t)1 << 20}; //the last three take the large path
+static const size_t reserve_size = (size_t)64 << 20; //bytes mm_reserve is asked for
+static const int reserve_blocks = 2000; //blocks allocated within the reservation; must not exceed the array in reserve
+
+/*
+ * fail: reports a failure and exits
+ */
+static void fail(const char *what, size_t alignment, size_t size)
+{
+    fprintf(stderr, "api: %s, alignment %zu, size %zu\n", what, alignment, size);
+    exit(1);
+}
+
+/*
+ * check_block: checks that p is aligned and has room for size bytes, writes all of its room, grows it with
+ *              realloc and checks the first size bytes came along, then frees it
+ */
+static void check_block(const char *name, void *p, size_t alignment, size_t size)
+{
+    size_t usable = mm_malloc_usable_size(p);
+    unsigned char *q;
+    size_t i;
+
+    if (p == NULL)
+    {
+        fail(name, alignment, size);
+    }
+    if ((uintptr_t)p % alignment != 0)
+    {
+        fail("misaligned block", alignment, size);
+    }
+    if (usable < size)
+    {
+        fail("usable size below the request", alignment, size);
+    }
+    memset(p, 0x5a, usable);
+
+    q = mm_realloc(p, 2*size + 100);
+    if (q == NULL)
+    {
+        fail("realloc of an aligned block", alignment, size);
+    }
+    for (i = 0; i < size; i++)
+    {
+        if (q[i] != 0x5a)
+        {
+            fail("realloc lost the contents of an aligned block", alignment, size);
+        }
+    }
+    mm_free(q);
+}
+
+/*
+ * aligned: runs the aligned allocation calls over every alignment and size
+ */
+static void aligned(void)
+{
+    size_t page = mem_pagesize();
+    size_t alignment;
+    size_t i;
+    void *p;
+
+    for (alignment = sizeof(void *); alignment <= max_alignment; alignment *= 2)
+    {
+        for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        {
+            size_t size = sizes[i];
+            if (mm_posix_memalign(&p, alignment, size) != 0)
+            {
+                fail("posix_memalign", alignment, size);
+            }
+            check_block("posix_memalign", p, alignment, size);
+            check_block("aligned_alloc", mm_aligned_alloc(alignment, size), alignment, size);
+            check_block("memalign", mm_memalign(alignment, size), alignment, size);
+        }
+    }
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        size_t size = sizes[i];
+        check_block("valloc", mm_valloc(size), page, size);
+        p = mm_pvalloc(size);
+        if (p != NULL && mm_malloc_usable_size(p) < (size + page - 1) / page * page)
+        {
+            fail("pvalloc did not round up to whole pages", page, size);
+        }
+        check_block("pvalloc", p, page, size);
+    }
+
+    // Alignments that are no power of two, or too small for posix_memalign, fail and leave *memptr alone
+    p = &p;
+    if (mm_posix_memalign(&p, 24, 100) != EINVAL || mm_posix_memalign(&p, sizeof(void *) / 2, 100) != EINVAL
+        || p != &p)
+    {
+        fail("posix_memalign took a bad alignment", 24, 100);
+    }
+    errno = 0;
+    if (mm_aligned_alloc(24, 100) != NULL || errno != EINVAL)
+    {
+        fail("aligned_alloc took a bad alignment", 24, 100);
+    }
+    if (mm_posix_memalign(&p, page, SIZE_MAX - 16) != ENOMEM)
+    {
+        fail("posix_memalign did not fail an oversized request", page, SIZE_MAX - 16);
+    }
+    errno = 0;
+    if (mm_pvalloc(SIZE_MAX - 16) != NULL || errno != ENOMEM)
+    {
+        fail("pvalloc did not fail an oversized request", page, SIZE_MAX - 16);
+    }
+}
+
+/*
+ * usable: checks mm_malloc_usable_size and mm_malloc_with_size, and the overflow checks of calloc and
+ *         reallocarray
+ */
+static void usable(void)
+{
+    size_t size;
+    size_t room;
+    void *p;
+
+    if (mm_malloc_usable_size(NULL) != 0)
+    {
+        fail("usable size of NULL", 0, 0);
+    }
+    for (size = 1; size < ((size_t)1 << 21); size += size / 4 + 1)
+    {
+        p = mm_malloc_with_size(size, &room);
+        if (p == NULL || room < size || room != mm_malloc_usable_size(p))
+        {
+            fail("malloc_with_size", 0, size);
+        }
+        memset(p, 0xa5, room); // all of the room is the caller's
+        p = mm_realloc(p, room); // and needs no move to fill
+        if (p == NULL || mm_malloc_usable_size(p) != room)
+        {
+            fail("realloc within the usable size", 0, size);
+        }
+        mm_free(p);
+        check_block("malloc", mm_malloc(size), 2*sizeof(void *), size);
+    }
+
+    errno = 0;
+    room = 1;
+    if (mm_malloc_with_size(SIZE_MAX - 16, &room) != NULL || room != 0 || errno != ENOMEM)
+    {
+        fail("malloc_with_size did not fail an oversized request", 0, SIZE_MAX - 16);
+    }
+    errno = 0;
+    if (mm_calloc(SIZE_MAX / 2, 3) != NULL || errno != ENOMEM)
+    {
+        fail("calloc did not fail an overflowing request", 3, SIZE_MAX / 2);
+    }
+    p = mm_malloc(100);
+    memset(p, 1, 100);
+    errno = 0;
+    if (p == NULL || mm_reallocarray(p, SIZE_MAX / 2, 3) != NULL || errno != ENOMEM || ((char *)p)[99] != 1)
+    {
+        fail("reallocarray did not fail an overflowing request", 3, SIZE_MAX / 2);
+    }
+    mm_free(p);
+}
+
+/*
+ * reserve: checks that blocks fitting in an mm_reserve come out of it without a heap extension
+ */
+static void reserve(void)
+{
+    static void *block[2000];
+    size_t extends;
+    size_t total = 0;
+    int i;
+
+    mem_reset_brk(); // on a new heap, so the blocks freed above cannot serve the mallocs below
+    mm_init();
+    if (!mm_reserve(reserve_size))
+    {
+        fail("mm_reserve", 0, reserve_size);
+    }
+    extends = mm_extend_count();
+    for (i = 0; i < reserve_blocks; i++)
+    {
+        size_t size = 16 + (size_t)i * 7919 % 30000; // 30 MiB in all, half the reservation
+        block[i] = mm_malloc(size);
+        if (block[i] == NULL)
+        {
+            fail("malloc in reserved heap", 0, size);
+        }
+        memset(block[i], i, size);
+        total += size;
+    }
+    if (mm_extend_count() != extends)
+    {
+        fprintf(stderr, "api: %zu heap extensions for %zu bytes within %zu reserved\n", mm_extend_count() - extends,
+                total, reserve_size);
+        exit(1);
+    }
+    for (i = 0; i < reserve_blocks; i++)
+    {
+        mm_free(block[i]);
+    }
+}
+
+int main(void)
+{
+    mem_init();
+    mm_init();
+
+    aligned();
+    usable();
+    if (!mm_checkheap(__LINE__))
+    {
+        fail("heap check", 0, 0);
+    }
+    reserve();
+    if (!mm_checkheap(__LINE__))
+    {
+        fail("heap check after mm_reserve", 0, 0);
+    }
+    printf("aligned, usable size and reserve ok\n");
+    return 0;
+}
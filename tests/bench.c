@@ -0,0 +1,196 @@
+/*
+ * bench.c: throughput microbenchmark for mm.c, built with DRIVER (see the Makefile's bench target).
+ *
+ * For each request size it reports the mean nanoseconds per operation of
+ *   - malloc, filling a batch of batch_size live blocks, or batch_bytes worth of large ones,
+ *   - free, releasing that batch in allocation order,
+ *   - pair, a malloc freed at once, the pattern a hot loop with a scratch buffer has,
+ *   - realloc, growing a block one step of the size at a time, and the share of those steps that moved it,
+ *   - realloc8, growing eight blocks in turn the same way, so none of them stays the last thing carved,
+ * and then the pair rate of several threads at once.
+ *
+ * Usage: bench [threads]. The sizes cover the first few segregated lists, the last open-ended one and
+ * large blocks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+static const size_t sizes[] = {16, 48, 100, 256, 1000, 4000, 16000, 65536, 262144, 1048576};
+static const int batch_size = 10000; //live blocks in a malloc or free batch
+static const size_t batch_bytes = (size_t)256 << 20; //most bytes live in a batch, which bounds it for large sizes
+static const int rounds = 20; //batches timed per size
+static const long pair_ops = 1000000; //malloc and free pairs timed per size and thread
+static const int realloc_steps = 64; //growth steps per timed realloc chain
+static const int realloc_chains = 8; //blocks grown in turn for realloc8; must not exceed the array in bench_size
+
+static void *batch[10000]; //the number inside brackets should match batch_size
+
+/*
+ * now_ns: monotonic time in nanoseconds
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/*
+ * pair_loop: times pair_ops malloc and free pairs of the given size, returning the elapsed nanoseconds
+ */
+static uint64_t pair_loop(size_t size)
+{
+    uint64_t start = now_ns();
+    long i;
+
+    for (i = 0; i < pair_ops; i++)
+    {
+        void *p = mm_malloc(size);
+        *(volatile char *)p = 1;
+        mm_free(p);
+    }
+    return now_ns() - start;
+}
+
+/*
+ * pair_thread: runs pair_loop on a thread, leaving the elapsed nanoseconds where arg points
+ */
+static void *pair_thread(void *arg)
+{
+    uint64_t *elapsed = arg;
+
+    *elapsed = pair_loop(*elapsed);
+    return NULL;
+}
+
+/*
+ * bench_size: prints single-threaded ns/op figures for one request size
+ */
+static void bench_size(size_t size)
+{
+    uint64_t malloc_ns = 0;
+    uint64_t free_ns = 0;
+    uint64_t realloc_ns = 0;
+    uint64_t realloc8_ns = 0;
+    mm_stats_t before;
+    mm_stats_t after;
+    void *chain[8];
+    uint64_t start;
+    int count = (size * batch_size > batch_bytes) ? (int)(batch_bytes / size) : batch_size;
+    int r;
+    int i;
+
+    for (r = 0; r < rounds; r++)
+    {
+        start = now_ns();
+        for (i = 0; i < count; i++)
+        {
+            batch[i] = mm_malloc(size);
+        }
+        malloc_ns += now_ns() - start;
+        for (i = 0; i < count; i++)
+        {
+            *(volatile char *)batch[i] = 1;
+        }
+        start = now_ns();
+        for (i = 0; i < count; i++)
+        {
+            mm_free(batch[i]);
+        }
+        free_ns += now_ns() - start;
+    }
+
+    mm_stats(&before);
+    for (r = 0; r < rounds; r++)
+    {
+        void *p = mm_malloc(size);
+        start = now_ns();
+        for (i = 2; i <= realloc_steps + 1; i++)
+        {
+            p = mm_realloc(p, size * i);
+        }
+        realloc_ns += now_ns() - start;
+        mm_free(p);
+    }
+    mm_stats(&after);
+
+    for (r = 0; r < rounds; r++)
+    {
+        int k;
+        for (k = 0; k < realloc_chains; k++)
+        {
+            chain[k] = mm_malloc(size);
+        }
+        start = now_ns();
+        for (i = 2; i <= realloc_steps + 1; i++)
+        {
+            for (k = 0; k < realloc_chains; k++)
+            {
+                chain[k] = mm_realloc(chain[k], size * i);
+            }
+        }
+        realloc8_ns += now_ns() - start;
+        for (k = 0; k < realloc_chains; k++)
+        {
+            mm_free(chain[k]);
+        }
+    }
+
+    printf("%9zu %9.1f %9.1f %9.1f %9.1f %8.0f%% %9.1f\n", size,
+           (double)malloc_ns / ((double)rounds * count),
+           (double)free_ns / ((double)rounds * count),
+           (double)pair_loop(size) / pair_ops,
+           (double)realloc_ns / ((double)rounds * realloc_steps),
+           100.0 * (after.copies - before.copies) / ((double)rounds * realloc_steps),
+           (double)realloc8_ns / ((double)rounds * realloc_steps * realloc_chains));
+}
+
+int main(int argc, char **argv)
+{
+    int threads = (argc > 1) ? atoi(argv[1]) : 4;
+    size_t s;
+    int i;
+
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+    mem_init();
+    mm_init();
+
+    printf("single thread, ns/op\n");
+    printf("%9s %9s %9s %9s %9s %9s %9s\n", "size", "malloc", "free", "pair", "realloc", "moved", "realloc8");
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        bench_size(sizes[s]);
+    }
+
+    printf("\n%d threads, ns per pair and thread\n", threads);
+    printf("%9s %9s\n", "size", "pair");
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        pthread_t tid[threads];
+        uint64_t elapsed[threads];
+        uint64_t total = 0;
+
+        for (i = 0; i < threads; i++)
+        {
+            elapsed[i] = sizes[s];
+            pthread_create(&tid[i], NULL, pair_thread, &elapsed[i]);
+        }
+        for (i = 0; i < threads; i++)
+        {
+            pthread_join(tid[i], NULL);
+            total += elapsed[i];
+        }
+        printf("%9zu %9.1f\n", sizes[s], (double)total / ((double)threads * pair_ops));
+    }
+    return !mm_checkheap(__LINE__);
+}
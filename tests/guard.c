@@ -0,0 +1,204 @@
+/*
+ * guard.c: checks the guard page build, built with DRIVER and GUARD_PAGES (see the Makefile's test target).
+ *
+ * Forked children take a guarded block and then write one byte past it, read it after freeing it, or free it
+ * twice; the first two must die of SIGSEGV and the last of SIGABRT. Another child grows a guarded block with
+ * realloc and checks its contents came along. Then random mallocs, callocs and frees run with one allocation
+ * in guard_rate guarded, checking every block against a pattern, calloc'd memory for zeros, and usable sizes.
+ * Built without GUARD_PAGES there is nothing to check.
+ *
+ * Usage: guard. Exits with status 1 at the first failure.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#ifdef GUARD_PAGES
+#define SLOTS 5000 //live blocks in the random run
+
+static const size_t guard_size = 100; //request size of the blocks the children misuse
+static const int guard_tries = 1000; //mallocs a child makes to get a guarded block
+static const unsigned int guard_rate = 3; //allocations per guarded one in the random run
+static const long random_ops = 400000; //operations in the random run
+static const size_t random_max = 6000; //largest request of the random run, some above a page
+
+enum misuse { overflow, use_after_free, double_free, grow };
+
+/*
+ * guarded: returns true if the block at p, with room for usable bytes, ends right at a page boundary, where
+ *          guard_malloc places it
+ */
+static bool guarded(void *p, size_t usable)
+{
+    return ((uintptr_t)p + usable) % mem_pagesize() == 0;
+}
+
+/*
+ * misuse_child: in a child, gets a guarded block and misuses it as told. Returns the signal that ended the
+ *               child, or 0 if it exited normally with status 0, or -1 otherwise.
+ */
+static int misuse_child(enum misuse how)
+{
+    int status;
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        volatile char *p = NULL;
+        int i;
+
+        freopen("/dev/null", "w", stderr); // a double free is reported before the abort, as expected here
+        mm_guard_sample(1);
+        for (i = 0; i < guard_tries && p == NULL; i++)
+        {
+            char *q = mm_malloc(guard_size);
+            if (guarded(q, mm_malloc_usable_size(q)))
+            {
+                p = q;
+            }
+        }
+        if (p == NULL)
+        {
+            _exit(2);
+        }
+        switch (how)
+        {
+        case overflow:
+            p[mm_malloc_usable_size((void *)p)] = 1;
+            break;
+        case use_after_free:
+            mm_free((void *)p);
+            printf("%d\n", p[0]);
+            break;
+        case double_free:
+            mm_free((void *)p);
+            mm_free((void *)p);
+            break;
+        case grow:
+            memset((void *)p, 7, guard_size);
+            p = mm_realloc((void *)p, 5000);
+            for (i = 0; i < (int)guard_size; i++)
+            {
+                if (p == NULL || p[i] != 7)
+                {
+                    _exit(3);
+                }
+            }
+            mm_free((void *)p);
+            break;
+        }
+        _exit(0);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) != pid)
+    {
+        return -1;
+    }
+    if (WIFSIGNALED(status))
+    {
+        return WTERMSIG(status);
+    }
+    return (WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+/*
+ * random_run: runs random mallocs, callocs and frees with one allocation in guard_rate guarded. Returns the
+ *             number of guarded blocks seen, or -1 at the first block found damaged.
+ */
+static long random_run(void)
+{
+    static void *slot[SLOTS];
+    unsigned int seed = 1;
+    long seen = 0;
+    long op;
+
+    mm_guard_sample(guard_rate);
+    for (op = 0; op < random_ops; op++)
+    {
+        int k = rand_r(&seed) % SLOTS;
+        if (slot[k] != NULL)
+        {
+            if (*(unsigned char *)slot[k] != (unsigned char)k)
+            {
+                return -1;
+            }
+            mm_free(slot[k]);
+            slot[k] = NULL;
+            continue;
+        }
+
+        size_t size = rand_r(&seed) % random_max + 1;
+        bool zero = rand_r(&seed) % 2;
+        unsigned char *p = zero ? mm_calloc(1, size) : mm_malloc(size);
+        size_t i;
+        if (p == NULL || mm_malloc_usable_size(p) < size)
+        {
+            return -1;
+        }
+        for (i = 0; zero && i < size; i++)
+        {
+            if (p[i] != 0)
+            {
+                return -1;
+            }
+        }
+        memset(p, k, size);
+        seen += guarded(p, mm_malloc_usable_size(p));
+        slot[k] = p;
+    }
+    for (op = 0; op < SLOTS; op++)
+    {
+        mm_free(slot[op]);
+    }
+    return seen;
+}
+#endif
+
+int main(void)
+{
+#ifdef GUARD_PAGES
+    long seen;
+
+    mem_init();
+    mm_init();
+
+    if (misuse_child(overflow) != SIGSEGV)
+    {
+        fprintf(stderr, "guard: overflow into the guard page did not fault\n");
+        return 1;
+    }
+    if (misuse_child(use_after_free) != SIGSEGV)
+    {
+        fprintf(stderr, "guard: read after free did not fault\n");
+        return 1;
+    }
+    if (misuse_child(double_free) != SIGABRT)
+    {
+        fprintf(stderr, "guard: double free did not abort\n");
+        return 1;
+    }
+    if (misuse_child(grow) != 0)
+    {
+        fprintf(stderr, "guard: realloc out of a guarded block lost its contents\n");
+        return 1;
+    }
+
+    seen = random_run();
+    if (seen <= 0 || !mm_checkheap(__LINE__))
+    {
+        fprintf(stderr, "guard: random run failed after %ld guarded blocks\n", seen);
+        return 1;
+    }
+    printf("guard faults ok, %ld blocks guarded in %ld operations\n", seen, random_ops);
+#else
+    printf("guard: built without GUARD_PAGES, nothing to check\n");
+#endif
+    return 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * latency.c: tail latency benchmark for mm.c, built with DRIVER (see the Makefile's latency target).
+ *
+ * Runs ops random mallocs and frees over live_slots slots and times each call on its own, then reports the
+ * mean, p99, p99.99 and maximum in nanoseconds, along with how often the heap was extended. Averages hide
+ * the rare call that extends the heap or walks a long free list; the top percentiles and the maximum are
+ * what a latency-bound caller sees. Built with -DBOUNDED_LATENCY, find_fit is constant time, and an
+ * mm_reserve ahead of the run leaves no heap extension on the timed path.
+ *
+ * Usage: latency [reserve MiB].
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define OPS 2000000 //timed calls
+
+static const int live_slots = 20000; //slots a call frees or fills; must not exceed the array in main
+
+static uint64_t latency[OPS];
+
+/*
+ * now_ns: monotonic time in nanoseconds
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/*
+ * compare_ns: qsort order of two latencies
+ */
+static int compare_ns(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+    static void *slot[20000];
+    unsigned int seed = 1;
+    uint64_t sum = 0;
+    long i;
+
+    mem_init();
+    mm_init();
+    if (argc > 1 && !mm_reserve((size_t)atol(argv[1]) << 20))
+    {
+        fprintf(stderr, "latency: mm_reserve failed\n");
+        return 1;
+    }
+
+    for (i = 0; i < OPS; i++)
+    {
+        int k = rand_r(&seed) % live_slots;
+        uint64_t start;
+
+        if (slot[k] != NULL)
+        {
+            start = now_ns();
+            mm_free(slot[k]);
+            latency[i] = now_ns() - start;
+            slot[k] = NULL;
+        }
+        else
+        {
+            size_t size = 16 + rand_r(&seed) % 4000;
+            if (rand_r(&seed) % 16 == 0)
+            {
+                size *= 8;
+            }
+            start = now_ns();
+            slot[k] = mm_malloc(size);
+            latency[i] = now_ns() - start;
+            *(volatile char *)slot[k] = 1;
+        }
+        sum += latency[i];
+    }
+
+    qsort(latency, OPS, sizeof(latency[0]), compare_ns);
+    printf("mean %.0f  p99 %lu  p99.99 %lu  max %lu ns\n", (double)sum / OPS,
+           (unsigned long)latency[OPS / 100 * 99], (unsigned long)latency[OPS / 10000 * 9999],
+           (unsigned long)latency[OPS - 1]);
+    printf("heap %zu bytes, %zu extensions\n", mem_heapsize(), mm_extend_count());
+    return !mm_checkheap(__LINE__);
+}
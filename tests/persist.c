@@ -0,0 +1,248 @@
+/*
+ * persist.c: checks the file-backed heap across restarts, built with DRIVER (see the Makefile's test target).
+ *
+ * Every run of a program on the heap file is a forked child, so each one starts with nothing mapped, as a new
+ * process would. A first run builds a list of nodes from the root pointer and detaches; the next reattaches,
+ * walks the list and extends it. A run that crashes, exiting without mm_detach after writing a pattern over
+ * memory, must leave no heap to attach to: the run after it gets a new, consistent heap in which calloc'd
+ * memory reads as zero, and which reattaches in turn once it detaches cleanly.
+ *
+ * Usage: persist [heap file]. The file is removed at the end. Exits with status 1 at the first failure.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+static const int nodes = 2000; //nodes a run adds to the list
+static const int crash_blocks = 2000; //blocks the crashing run fills
+static const size_t crash_size = 4000; //bytes in each of them
+
+typedef struct node
+{
+    struct node *next;
+    int value;
+    char data[100];
+} node_t;
+
+static const char *heap_file;
+
+/*
+ * attach: maps the heap file and attaches to the heap in it. Returns true if the file already held a heap.
+ */
+static bool attach(void)
+{
+    bool found = mem_init_file(heap_file);
+
+    if (!mm_attach())
+    {
+        fprintf(stderr, "persist: mm_attach failed\n");
+        _exit(1);
+    }
+    return found;
+}
+
+/*
+ * detach: saves the heap and unmaps the file, as a clean exit does
+ */
+static void detach(void)
+{
+    mm_detach();
+    mem_deinit();
+}
+
+/*
+ * add_nodes: pushes nodes onto the list at the root, with values from first up, freeing a block between two
+ *            so the list is spread over free blocks too
+ */
+static void add_nodes(int first)
+{
+    int i;
+
+    for (i = first; i < first + nodes; i++)
+    {
+        node_t *node = mm_malloc(sizeof(node_t));
+        void *gap = mm_malloc(50 + i % 200);
+        if (node == NULL || gap == NULL)
+        {
+            fprintf(stderr, "persist: out of memory\n");
+            _exit(1);
+        }
+        node->value = i;
+        memset(node->data, i & 0xff, sizeof(node->data));
+        node->next = mm_get_root();
+        mm_set_root(node);
+        mm_free(gap);
+    }
+}
+
+/*
+ * count_nodes: walks the list at the root and returns its length, or -1 if a node does not hold what
+ *              add_nodes wrote, the values counting down from the head
+ */
+static int count_nodes(void)
+{
+    node_t *node;
+    int n = 0;
+    int expect = -1;
+
+    for (node = mm_get_root(); node != NULL; node = node->next, n++)
+    {
+        if ((expect >= 0 && node->value != expect) || node->data[0] != (char)(node->value & 0xff)
+            || node->data[sizeof(node->data) - 1] != (char)(node->value & 0xff))
+        {
+            return -1;
+        }
+        expect = node->value - 1;
+    }
+    return n;
+}
+
+/*
+ * first_run: starts a new heap, builds the list and detaches
+ */
+static int first_run(void)
+{
+    attach();
+    if (mm_get_root() != NULL)
+    {
+        return 2;
+    }
+    add_nodes(0);
+    detach();
+    return 0;
+}
+
+/*
+ * restart: reattaches, checks the list and the heap, extends the list and detaches
+ */
+static int restart(void)
+{
+    if (!attach() || count_nodes() != nodes || !mm_checkheap(__LINE__))
+    {
+        return 2;
+    }
+    add_nodes(nodes);
+    detach();
+    return 0;
+}
+
+/*
+ * crash: reattaches, checks the list, writes a pattern over many blocks and exits without detaching
+ */
+static int crash(void)
+{
+    int i;
+
+    if (!attach() || count_nodes() != 2*nodes)
+    {
+        return 2;
+    }
+    for (i = 0; i < crash_blocks; i++)
+    {
+        char *p = mm_malloc(crash_size);
+        if (p == NULL)
+        {
+            return 2;
+        }
+        memset(p, 0xaa, crash_size);
+        if (i % 2)
+        {
+            mm_free(p);
+        }
+    }
+    _exit(0);
+}
+
+/*
+ * after_crash: attaches after a crash, which must give a new heap whose calloc'd memory reads as zero,
+ *              then builds a list in it and detaches
+ */
+static int after_crash(void)
+{
+    int i;
+    size_t j;
+
+    attach();
+    if (mm_get_root() != NULL || !mm_checkheap(__LINE__))
+    {
+        return 2;
+    }
+    for (i = 0; i < crash_blocks; i++)
+    {
+        unsigned char *p = mm_calloc(1, crash_size);
+        if (p == NULL)
+        {
+            return 2;
+        }
+        for (j = 0; j < crash_size; j++)
+        {
+            if (p[j] != 0)
+            {
+                fprintf(stderr, "persist: calloc returned memory the crashed run wrote\n");
+                return 2;
+            }
+        }
+    }
+    add_nodes(0);
+    detach();
+    return 0;
+}
+
+/*
+ * last_run: reattaches to the heap made after the crash
+ */
+static int last_run(void)
+{
+    if (!attach() || count_nodes() != nodes || !mm_checkheap(__LINE__))
+    {
+        return 2;
+    }
+    detach();
+    return 0;
+}
+
+/*
+ * run: runs one program on the heap file in a child process and returns true if it did what it should
+ */
+static bool run(const char *name, int (*program)(void))
+{
+    int status;
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        _exit(program());
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "persist: %s failed\n", name);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    char path[64];
+    bool ok;
+
+    snprintf(path, sizeof(path), "/tmp/mm-persist-%d.heap", (int)getpid());
+    heap_file = (argc > 1) ? argv[1] : path;
+    unlink(heap_file);
+
+    ok = run("first run", first_run) && run("restart", restart) && run("crash", crash)
+        && run("restart after crash", after_crash) && run("last run", last_run);
+    unlink(heap_file);
+    if (!ok)
+    {
+        return 1;
+    }
+    printf("attach, detach and crash restart ok\n");
+    return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * rss.c: checks that freed large blocks do not stay resident, built with DRIVER (see the Makefile's test target).
+ *
+ * Allocates, writes and frees 512 blocks of 1 MiB, then 512 of 300 KiB, which are too small to reuse the
+ * first ones, and checks that the resident set afterwards has grown by no more than the large block cache
+ * (32 MiB) plus slack, although 662 MiB were written.
+ *
+ * Usage: rss. Exits with status 1 on failure.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define BLOCKS 512
+
+static const size_t rss_slack = (size_t)64 << 20; //most growth of the resident set allowed once everything is freed
+
+/*
+ * resident: returns the resident set of the process in bytes
+ */
+static size_t resident(void)
+{
+    unsigned long size = 0;
+    unsigned long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (f == NULL || fscanf(f, "%lu %lu", &size, &pages) != 2)
+    {
+        fprintf(stderr, "rss: cannot read /proc/self/statm\n");
+        exit(1);
+    }
+    fclose(f);
+    return pages * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * churn: allocates and writes BLOCKS blocks of size bytes, then frees them all. Returns false if one fails.
+ */
+static bool churn(size_t size)
+{
+    static void *block[BLOCKS];
+    int i;
+
+    for (i = 0; i < BLOCKS; i++)
+    {
+        block[i] = mm_malloc(size);
+        if (block[i] == NULL)
+        {
+            return false;
+        }
+        memset(block[i], i, size);
+    }
+    for (i = 0; i < BLOCKS; i++)
+    {
+        mm_free(block[i]);
+    }
+    return true;
+}
+
+int main(void)
+{
+    size_t before;
+    size_t after;
+
+    mem_init();
+    mm_init();
+    before = resident();
+
+    if (!churn((size_t)1 << 20) || !churn((size_t)300 << 10))
+    {
+        fprintf(stderr, "rss: out of memory\n");
+        return 1;
+    }
+    after = resident();
+
+    printf("resident set grew by %zu KiB\n", (after - before) >> 10);
+    if (after > before + rss_slack || !mm_checkheap(__LINE__))
+    {
+        fprintf(stderr, "rss: freed large blocks stayed resident\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,409 @@
+/*
+ * stress.c: randomized stress test for mm.c, built with DRIVER (see the Makefile's test target).
+ *
+ * A single-threaded phase runs random malloc, calloc, realloc and free calls of small and large sizes over a
+ * table of live blocks. Every block is filled with a pattern derived from its slot, which is checked before the
+ * block is freed or resized, and calloc'd memory is checked to read as zero. mm_checkheap runs every
+ * check_period operations. The phase then resets the heap and runs again, so blocks are also carved from memory
+ * an earlier heap has written.
+ *
+ * A multi-threaded phase then runs a producer handing blocks to a consumer that frees them, so every one of
+ * those frees is a cross-thread free, next to mixed workers doing their own random calls, a thread moving
+ * movable blocks with mm_compact, and the background purge thread. It runs in epochs, and mm_checkheap,
+ * which needs the heap to itself, runs between them once every thread has stopped.
+ *
+ * Usage: stress [seed]. Exits with status 1 at the first failure.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define SLOTS 4000 //live blocks in the single-threaded phase
+#define RING 1024 //blocks in flight between producer and consumer
+
+#ifdef DEBUG // mm.c checks the heap on every change already, so far fewer operations cover as much
+static const long single_ops = 5000; //operations per single-threaded round
+static const long check_period = 1000; //operations between heap checks
+static const long handoff_ops = 5000; //blocks the producer hands to the consumer per epoch
+static const long worker_ops = 5000; //operations per mixed worker and epoch
+#else
+static const long single_ops = 200000; //operations per single-threaded round
+static const long check_period = 5000; //operations between heap checks
+static const long handoff_ops = 100000; //blocks the producer hands to the consumer per epoch
+static const long worker_ops = 75000; //operations per mixed worker and epoch
+#endif
+static const int workers = 4; //number of mixed workers
+static const int worker_slots = 64; //live blocks per mixed worker; must not exceed the array in worker
+static const int movable_slots = 32; //live movable blocks; must not exceed the array in compactor
+static const int epochs = 4; //multi-threaded runs, with a heap check after each
+
+static void *slot_ptr[SLOTS];
+static size_t slot_size[SLOTS];
+static _Atomic(void *) ring[RING];
+static atomic_bool done;
+static atomic_bool failed;
+
+/*
+ * fail: reports a failure and makes every thread stop
+ */
+static void fail(const char *what, long op)
+{
+    fprintf(stderr, "stress: %s at operation %ld\n", what, op);
+    atomic_store(&failed, true);
+}
+
+/*
+ * random_size: picks a request size, mostly small, with one in ten up to large_max bytes
+ */
+static size_t random_size(unsigned int *seed, size_t large_max)
+{
+    if (rand_r(seed) % 10 == 0)
+    {
+        return rand_r(seed) % large_max + 1;
+    }
+    return rand_r(seed) % 500 + 1;
+}
+
+/*
+ * fill: writes the pattern of key over size bytes at p
+ */
+static void fill(void *p, size_t size, unsigned int key)
+{
+    memset(p, key & 0xff, size);
+}
+
+/*
+ * holds: returns true if the size bytes at p still hold the pattern of key
+ */
+static bool holds(const void *p, size_t size, unsigned int key)
+{
+    const unsigned char *c = p;
+    size_t i;
+
+    for (i = 0; i < size; i++)
+    {
+        if (c[i] != (unsigned char)(key & 0xff))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * is_zero: returns true if the size bytes at p are all zero
+ */
+static bool is_zero(const void *p, size_t size)
+{
+    const unsigned char *c = p;
+    size_t i;
+
+    for (i = 0; i < size; i++)
+    {
+        if (c[i] != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * single_round: one single-threaded round of random operations over the slot table. Returns false on failure.
+ */
+static bool single_round(unsigned int *seed)
+{
+    long op;
+
+    for (op = 0; op < single_ops; op++)
+    {
+        int i = rand_r(seed) % SLOTS;
+        int kind = rand_r(seed) % 4;
+
+        if (slot_ptr[i] != NULL)
+        {
+            if (!holds(slot_ptr[i], slot_size[i], i))
+            {
+                fail("block overwritten", op);
+                return false;
+            }
+            if (kind == 0)
+            {
+                size_t size = random_size(seed, 300000);
+                size_t kept = (size < slot_size[i]) ? size : slot_size[i];
+                slot_ptr[i] = mm_realloc(slot_ptr[i], size);
+                if (slot_ptr[i] == NULL || !holds(slot_ptr[i], kept, i))
+                {
+                    fail("realloc lost data", op);
+                    return false;
+                }
+                slot_size[i] = size;
+                fill(slot_ptr[i], size, i);
+            }
+            else
+            {
+                mm_free(slot_ptr[i]);
+                slot_ptr[i] = NULL;
+            }
+        }
+        else
+        {
+            size_t size = random_size(seed, 300000);
+            slot_ptr[i] = (kind == 1) ? mm_calloc(1, size) : mm_malloc(size);
+            if (slot_ptr[i] == NULL)
+            {
+                fail("out of memory", op);
+                return false;
+            }
+            if ((uintptr_t)slot_ptr[i] % 16 != 0)
+            {
+                fail("misaligned payload", op);
+                return false;
+            }
+            if (kind == 1 && !is_zero(slot_ptr[i], size))
+            {
+                fail("calloc returned dirty memory", op);
+                return false;
+            }
+            slot_size[i] = size;
+            fill(slot_ptr[i], size, i);
+        }
+        if (op % check_period == 0 && !mm_checkheap(__LINE__))
+        {
+            fail("mm_checkheap failed", op);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * producer: allocates blocks, stamps their size in the first word, and hands them to the consumer
+ */
+static void *producer(void *arg)
+{
+    long op;
+
+    for (op = 0; op < handoff_ops && !atomic_load(&failed); op++)
+    {
+        size_t size = (op * 7919) % ((op % 50 == 0) ? 200000 : 300) + sizeof(size_t);
+        size_t *p = mm_malloc(size);
+        void *empty = NULL;
+
+        if (p == NULL)
+        {
+            fail("producer out of memory", op);
+            break;
+        }
+        fill(p, size, (unsigned int)size);
+        p[0] = size;
+        while (!atomic_compare_exchange_weak(&ring[op % RING], &empty, p))
+        {
+            if (atomic_load(&failed))
+            {
+                return NULL;
+            }
+            empty = NULL;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * consumer: frees what the producer allocated, after checking it arrived intact
+ */
+static void *consumer(void *arg)
+{
+    long op;
+
+    for (op = 0; op < handoff_ops && !atomic_load(&failed); op++)
+    {
+        size_t *p;
+        while ((p = atomic_exchange(&ring[op % RING], NULL)) == NULL)
+        {
+            if (atomic_load(&failed))
+            {
+                return NULL;
+            }
+        }
+        if (!holds(p + 1, p[0] - sizeof(size_t), (unsigned int)p[0]))
+        {
+            fail("handed off block overwritten", op);
+        }
+        mm_free(p);
+    }
+    return NULL;
+}
+
+/*
+ * worker: random malloc, calloc, realloc and free calls over its own blocks
+ */
+static void *worker(void *arg)
+{
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+    unsigned int key = seed << 8;
+    void *ptr[64] = {NULL};
+    size_t size[64];
+    long op;
+    int i;
+
+    for (op = 0; op < worker_ops && !atomic_load(&failed); op++)
+    {
+        i = rand_r(&seed) % worker_slots;
+        if (ptr[i] != NULL)
+        {
+            if (!holds(ptr[i], size[i], key + i))
+            {
+                fail("worker block overwritten", op);
+                break;
+            }
+            if (op % 3 == 0)
+            {
+                size_t new_size = random_size(&seed, 150000);
+                size_t kept = (new_size < size[i]) ? new_size : size[i];
+                ptr[i] = mm_realloc(ptr[i], new_size);
+                if (ptr[i] == NULL || !holds(ptr[i], kept, key + i))
+                {
+                    fail("worker realloc lost data", op);
+                    break;
+                }
+                size[i] = new_size;
+                fill(ptr[i], new_size, key + i);
+            }
+            else
+            {
+                mm_free(ptr[i]);
+                ptr[i] = NULL;
+            }
+        }
+        else
+        {
+            size[i] = random_size(&seed, 150000);
+            ptr[i] = (op & 1) ? mm_malloc(size[i]) : mm_calloc(1, size[i]);
+            if (ptr[i] == NULL)
+            {
+                fail("worker out of memory", op);
+                break;
+            }
+            if (!(op & 1) && !is_zero(ptr[i], size[i]))
+            {
+                fail("worker calloc returned dirty memory", op);
+                break;
+            }
+            fill(ptr[i], size[i], key + i);
+        }
+    }
+    for (i = 0; i < worker_slots; i++)
+    {
+        mm_free(ptr[i]);
+    }
+    return NULL;
+}
+
+/*
+ * compactor: keeps a set of movable blocks changing and compacts the heap, checking the blocks after every move
+ */
+static void *compactor(void *arg)
+{
+    void *handle[32] = {NULL};
+    size_t size[32];
+    long op = 0;
+    int i;
+
+    while (!atomic_load(&done) && !atomic_load(&failed))
+    {
+        i = op % movable_slots;
+        if (handle[i] != NULL)
+        {
+            mm_free_movable(&handle[i]);
+        }
+        size[i] = op % 500 + 1;
+        if (mm_malloc_movable(size[i], &handle[i]) == NULL)
+        {
+            fail("movable out of memory", op);
+            break;
+        }
+        fill(handle[i], size[i], i);
+        mm_compact();
+        for (i = 0; i < movable_slots; i++)
+        {
+            if (handle[i] != NULL && !holds(handle[i], size[i], i))
+            {
+                fail("movable block lost data", op);
+                break;
+            }
+        }
+        op++;
+    }
+    for (i = 0; i < movable_slots; i++)
+    {
+        if (handle[i] != NULL)
+        {
+            mm_free_movable(&handle[i]);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int seed = (argc > 1) ? (unsigned int)atoi(argv[1]) : 1;
+    pthread_t busy[2 + workers];
+    pthread_t mover;
+    int round;
+    int epoch;
+    int i;
+
+    mem_init();
+    mm_init();
+
+    for (round = 0; round < 2; round++)
+    {
+        if (round > 0)
+        {
+            memset(slot_ptr, 0, sizeof(slot_ptr));
+            mem_reset_brk();
+            mm_init();
+        }
+        if (!single_round(&seed))
+        {
+            return 1;
+        }
+    }
+    printf("single-threaded ok, heap %zu bytes\n", mem_heapsize());
+
+    for (epoch = 0; epoch < epochs; epoch++)
+    {
+        atomic_store(&done, false);
+        mm_purge_start(1);
+        pthread_create(&busy[0], NULL, producer, NULL);
+        pthread_create(&busy[1], NULL, consumer, NULL);
+        for (i = 0; i < workers; i++)
+        {
+            pthread_create(&busy[2 + i], NULL, worker, (void *)(uintptr_t)(seed + epoch * workers + i + 1));
+        }
+        pthread_create(&mover, NULL, compactor, NULL);
+        for (i = 0; i < 2 + workers; i++)
+        {
+            pthread_join(busy[i], NULL);
+        }
+        atomic_store(&done, true);
+        pthread_join(mover, NULL);
+        mm_purge_stop();
+
+        if (atomic_load(&failed) || !mm_checkheap(__LINE__))
+        {
+            fprintf(stderr, "stress: multi-threaded epoch %d failed\n", epoch);
+            return 1;
+        }
+    }
+    printf("multi-threaded ok, heap %zu bytes\n", mem_heapsize());
+    return 0;
+}